@@ -0,0 +1,43 @@
+org $0000
+
+.Start
+   ld d, 64
+
+.Loop
+   ; fill $8000~$9FFF
+   ld hl, $8000
+   ld bc, $2000
+.Fill
+   ld (hl), c
+   inc hl
+   dec bc
+   ld a, b
+   or c
+   jr nz, Fill
+
+   ; sum up $8000~$9FFF to E
+   ld hl, $8000
+   ld bc, $2000
+   ld e, 0
+.Sum
+   ld a, e
+   add a, (hl)
+   ld e, a
+   inc hl
+   dec bc
+   ld a, b
+   or c
+   jr nz, Sum
+
+   ; copy $8000~$9FFF to $A000~$BFFF
+   push de
+   ld hl, $8000
+   ld de, $A000
+   ld bc, $2000
+   ldir
+   pop de
+
+   dec d
+   jr nz, Loop
+   xor a
+   ret
@@ -0,0 +1,29 @@
+#include "z80console_builtin.hpp"
+#include <stdio.h>
+
+/**
+ * @brief 入力（IN）処理
+ * @param (ctx) 呼び出し元 Z80 のインスタンス
+ * @param (port) 入力ポート番号
+ * @return 入力結果
+ */
+static unsigned char in(void* ctx, unsigned char port)
+{
+    printf("builtin: Invoked in(%02X)\n", port);
+    return 0;
+}
+
+/**
+ * @brief 出力（OUT）処理
+ * @param (ctx) 呼び出し元 Z80 のインスタンス
+ * @param (port) 出力ポート番号
+ * @param (value) 出力値
+ */
+static void out(void* ctx, unsigned char port, unsigned char value)
+{
+    printf("builtin: Invoked out(%02X) = %02X\n", port, value);
+}
+
+// z80con に builtin:hello_in, builtin:hello_out として登録
+Z80CONSOLE_BUILTIN(hello_in, in);
+Z80CONSOLE_BUILTIN(hello_out, out);
@@ -0,0 +1,12 @@
+org $0000
+
+.Start
+   ld hl, DATA
+   ld bc, $0CC0
+   otir
+   in a, ($C0)
+   ld a, 0
+   ret
+
+DATA:
+   db "Hello, World"
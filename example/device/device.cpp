@@ -0,0 +1,68 @@
+#include "z80console_device.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * @brief デバイスの状態（インスタンス毎に確保）
+ */
+struct Checksum {
+    unsigned char sum;
+    int count;
+    long clocks;
+};
+
+static unsigned char in(void* userData, unsigned char port)
+{
+    auto checksum = (Checksum*)userData;
+    printf("libdevice.so: Invoked in(%02X) = %02X\n", port, checksum->sum);
+    return checksum->sum;
+}
+
+static void out(void* userData, unsigned char port, unsigned char value)
+{
+    auto checksum = (Checksum*)userData;
+    checksum->sum += value;
+    checksum->count++;
+}
+
+/**
+ * @brief OTIR/OTDR の出力（B レジスタ分のデータを 1 回で受け取る）
+ */
+static void outBlock(void* userData, unsigned char port, const unsigned char* buffer, int size)
+{
+    auto checksum = (Checksum*)userData;
+    printf("libdevice.so: Invoked outBlock(%02X) size = %d\n", port, size);
+    for (int i = 0; i < size; i++) checksum->sum += buffer[i];
+    checksum->count += size;
+}
+
+static void tick(void* userData, int clocks)
+{
+    ((Checksum*)userData)->clocks += clocks;
+}
+
+static void destroy(void* userData)
+{
+    auto checksum = (Checksum*)userData;
+    printf("libdevice.so: Invoked destroy() count = %d, clocks = %ld\n", checksum->count, checksum->clocks);
+    free(checksum);
+}
+
+/**
+ * @brief デバイスの初期化処理（ディスクリプタを設定する）
+ * @param (device) ディスクリプタ（version にはホスト側のバージョンが設定されている）
+ * @return 成功時は 0
+ */
+extern "C" int checksum(Z80ConsoleDevice* device)
+{
+    if (device->version < Z80CONSOLE_DEVICE_VERSION) return -1;
+    device->version = Z80CONSOLE_DEVICE_VERSION;
+    device->capabilities = Z80CONSOLE_DEVICE_IN | Z80CONSOLE_DEVICE_OUT | Z80CONSOLE_DEVICE_OUT_BLOCK | Z80CONSOLE_DEVICE_TICK;
+    device->userData = calloc(1, sizeof(Checksum));
+    device->in = in;
+    device->out = out;
+    device->outBlock = outBlock;
+    device->tick = tick;
+    device->destroy = destroy;
+    return device->userData ? 0 : -1;
+}
@@ -0,0 +1,14 @@
+org $0000
+
+.Start
+   ld hl, $8000
+   ld bc, $8000
+   in a, ($0C)
+   and a
+   jr nz, End
+   out ($0D), a
+   jr Start
+
+.End
+   sub 1
+   ret
@@ -0,0 +1,48 @@
+org $0000
+
+.Start
+   ld d, 4
+
+.Loop
+   ; fill $8000~$80FF
+   ld hl, $8000
+   ld b, 0
+.Fill
+   ld (hl), b
+   inc hl
+   djnz Fill
+
+   ; sum up $8000~$80FF to E
+   ld hl, $8000
+   ld b, 0
+   ld e, 0
+.Sum
+   ld a, e
+   add a, (hl)
+   ld e, a
+   inc hl
+   djnz Sum
+
+   ; copy $8000~$80FF to $8100~$81FF
+   push de
+   ld hl, $8000
+   ld de, $8100
+   ld bc, $0100
+   ldir
+   pop de
+
+   ; print the loop counter
+   ld a, d
+   add a, '0'
+   ld hl, $8200
+   ld (hl), a
+   inc hl
+   ld (hl), $0A
+   dec hl
+   ld a, 2
+   out ($0F), a
+
+   dec d
+   jr nz, Loop
+   xor a
+   ret
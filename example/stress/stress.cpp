@@ -0,0 +1,107 @@
+#include "z80console.hpp"
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define STRESS_THREADS 64
+
+/**
+ * @brief 1 スレッド分の実行結果
+ */
+struct StressResult {
+    std::string debug;  // Z80::setDebugMessage のメッセージ
+    std::string trace;  // Z80Console::setTrace の出力
+    std::string output; // コンソール出力
+    bool isEnded;
+};
+
+// デバッグメッセージの出力先（スレッド毎）
+static thread_local std::string* debugLog;
+
+static void debugMessage(void* ctx, const char* message)
+{
+    *debugLog += message;
+    *debugLog += '\n';
+}
+
+static bool readAll(FILE* fp, std::string& data)
+{
+    char buf[4096];
+    size_t size;
+    fflush(fp);
+    rewind(fp);
+    data.clear();
+    while (0 < (size = fread(buf, 1, sizeof(buf), fp))) data.append(buf, size);
+    return !ferror(fp);
+}
+
+/**
+ * @brief スレッド毎に Console を生成し、デバッグメッセージとトレースを有効にしてプログラムを実行する
+ * @param (rom) プログラム
+ * @param (result) 実行結果
+ */
+static void run(const std::vector<unsigned char>* rom, StressResult* result)
+{
+    Z80Console console;
+    MemoryConsoleSink sink;
+    MemoryConsoleSource source;
+    console.setConsoleSink(&sink);
+    console.setConsoleSource(&source);
+    console.addRomData(rom->data(), (int)rom->size());
+    debugLog = &result->debug;
+    console.cpu->setDebugMessage(debugMessage);
+    FILE* fp = tmpfile();
+    if (fp) console.setTrace(fp);
+    while (!console.isEnded()) {
+        if (console.execute(0x10000) < 1) break;
+    }
+    console.setTrace(NULL);
+    console.flushConsoleOutput();
+    result->isEnded = console.isEnded();
+    result->output.assign((const char*)sink.getData(), sink.getSize());
+    if (fp) {
+        readAll(fp, result->trace);
+        fclose(fp);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: stress my-program.bin\n");
+        return 1;
+    }
+    FILE* fp = fopen(argv[1], "rb");
+    if (!fp) {
+        fprintf(stderr, "error: ROM file not found (%s)\n", argv[1]);
+        return 1;
+    }
+    std::string data;
+    readAll(fp, data);
+    fclose(fp);
+    std::vector<unsigned char> rom(data.begin(), data.end());
+
+    std::vector<StressResult> results(STRESS_THREADS);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < STRESS_THREADS; i++) threads.push_back(std::thread(run, &rom, &results[i]));
+    for (auto& thread : threads) thread.join();
+
+    // 全てのスレッドの実行結果は 1 スレッド目と一致する
+    int errors = 0;
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        auto result = &results[i];
+        if (!result->isEnded || result->debug.empty() || result->trace.empty() ||
+            result->debug != results[0].debug || result->trace != results[0].trace || result->output != results[0].output) {
+            fprintf(stderr, "error: The result of thread %d is different from thread 1\n", i + 1);
+            errors++;
+        }
+    }
+    printf("%d threads: %d debug bytes, %d trace bytes, %d output bytes per thread (%s)\n",
+           STRESS_THREADS,
+           (int)results[0].debug.size(),
+           (int)results[0].trace.size(),
+           (int)results[0].output.size(),
+           errors ? "with errors" : "no errors");
+    return errors ? 1 : 0;
+}
@@ -25,39 +25,146 @@
  * -----------------------------------------------------------------------------
  */
 #include "z80console.hpp"
+#include "z80console_builtin.hpp"
+#include <condition_variable>
+#include <deque>
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <functional>
 #include <limits.h>
+#include <list>
 #include <map>
+#include <mutex>
+#include <poll.h>
+#include <set>
+#include <signal.h>
 #include <string>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <thread>
+#include <time.h>
 #include <unistd.h>
 
 static void printUsage()
 {
-    fprintf(stderr, "usage: z80con [-p {i|o} {00|01|02...FF} my-plugin-so:function]\n");
-    fprintf(stderr, "              [-m {r|w} {00|01|02...FF} my-mmap-so:function]");
+    fprintf(stderr, "usage: z80con [-p {i|o|oa|d} {00|01|02...FF} my-plugin-so:function]\n");
+    fprintf(stderr, "              [-m {r|w|r16|w16|rb|wb} {00|01|02...FF} my-mmap-so:function]\n");
     fprintf(stderr, "              [-r {0|1|2...7}[:{0|1|2...7}]]\n");
     fprintf(stderr, "              [-c [clocks-per-second]]\n");
-    fprintf(stderr, "              [-v [{stdout|stderr}]]\n");
+    fprintf(stderr, "              [-v [{stdout|stderr}] [pc=start-end] [bank=number] [count=[from-]to]]\n");
+    fprintf(stderr, "              [-i {sync|async}]\n");
+    fprintf(stderr, "              [-q {clocks|frequency-Hz} [stats]]\n");
+    fprintf(stderr, "              [-P]\n");
+    fprintf(stderr, "              [-b [runs[:max-clocks]] [json]]\n");
+    fprintf(stderr, "              [--max-cycles clocks] [--max-instructions count] [--timeout-ms milliseconds]\n");
+    fprintf(stderr, "              [--stats={file|-}]\n");
     fprintf(stderr, "              my-program.bin\n");
+    fprintf(stderr, "       z80con [options] [-j threads] --batch jobs.txt\n");
+    fprintf(stderr, "       z80con [options] [-j consoles] --serve socket-path\n");
+    fprintf(stderr, "       z80con [options] --fork-server [pc=address|cycle=clocks] my-program.bin\n");
 }
 
 #define DEFAULT_CLOCK_RATE 3579545L
-static long clockRate = 0L;
-static long clockRateM = 0L;
-static long consumedClocks = 0L;
+#define PACING_SPIN_NS 100000ULL         // spin (instead of sleep) in the last 100us before the deadline
+#define PACING_REBASE_NS 100000000ULL    // restart the deadlines if the emulation lags over 100ms (e.g. waiting for the input)
 
-static void consumeClock(void* arg, int clocks)
+static unsigned long long monotonicNs()
 {
-    consumedClocks += clocks;
-    if (clockRateM < consumedClocks) {
-        long sleepMilliSec = consumedClocks / clockRateM;
-        usleep(sleepMilliSec * 1000);
-        consumedClocks -= sleepMilliSec * clockRateM;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleepUntil(unsigned long long ns)
+{
+#ifdef __APPLE__
+    unsigned long long now = monotonicNs();
+    if (ns <= now) return;
+    struct timespec ts;
+    ts.tv_sec = (ns - now) / 1000000000ULL;
+    ts.tv_nsec = (ns - now) % 1000000000ULL;
+    nanosleep(&ts, NULL);
+#else
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) {}
+#endif
+}
+
+// Pace the emulated clock to the absolute deadline of each cycle (no drift by the host time spent in the emulation)
+class ClockPacer
+{
+  private:
+    long clockRate;
+    unsigned long long startNs;
+    unsigned long long startCycles;
+    unsigned long long baseNs;
+    unsigned long long baseCycles;
+    unsigned long long maxLagNs;
+
+  public:
+    ClockPacer() { setClockRate(0); }
+    void setClockRate(long clockRate) { this->clockRate = clockRate; }
+    long getClockRate() { return clockRate; }
+
+    void start(unsigned long long cycles)
+    {
+        startNs = baseNs = monotonicNs();
+        startCycles = baseCycles = cycles;
+        maxLagNs = 0;
+    }
+
+    // wait for the deadline of the cycles (sleep until shortly before it, and spin the rest), returns false if already late
+    bool wait(unsigned long long cycles)
+    {
+        if (clockRate < 1) return true;
+        unsigned long long elapsed = cycles - baseCycles;
+        unsigned long long deadline = baseNs + elapsed / clockRate * 1000000000ULL + elapsed % clockRate * 1000000000ULL / clockRate;
+        unsigned long long now = monotonicNs();
+        if (deadline <= now) {
+            if (maxLagNs < now - deadline) maxLagNs = now - deadline;
+            if (PACING_REBASE_NS < now - deadline) {
+                baseNs = now;
+                baseCycles = cycles;
+            }
+            return false;
+        }
+        if (PACING_SPIN_NS < deadline - now) sleepUntil(deadline - PACING_SPIN_NS);
+        while (monotonicNs() < deadline) {}
+        return true;
+    }
+
+    void printReport(unsigned long long cycles)
+    {
+        unsigned long long elapsedNs = monotonicNs() - startNs;
+        fprintf(stderr, "Clock: %.6f MHz (requested: %.6f MHz), max lag: %llu us\n",
+                elapsedNs ? (cycles - startCycles) * 1000.0 / elapsedNs : 0.0,
+                clockRate / 1000000.0,
+                maxLagNs / 1000);
     }
+};
+
+static volatile sig_atomic_t profileRequested = 0;
+
+static void requestProfile(int signal)
+{
+    profileRequested = 1;
 }
 
-static void* searchSymbol(Z80Console& console, std::map<std::string, void*>& dlHandles, const char* lib, const char* symbol)
+// The plugins loading to a console
+struct PluginLoader {
+    std::map<std::string, void*>* dlHandles; // the libraries shared by the consoles (closed at exit)
+    std::set<std::string> libs;              // the libraries registered the start/end handlers to the console
+    bool isQuiet;                            // do not print the loading messages (the consoles of the batch workers)
+};
+
+static void* searchSymbol(Z80Console& console, PluginLoader& loader, const char* lib, const char* symbol)
 {
+    if (0 == strcmp(lib, "builtin")) return Z80ConsoleBuiltin::find(symbol); // linked statically (make builtin)
+    auto& dlHandles = *loader.dlHandles;
     auto itr = dlHandles.find(lib);
     if (itr == dlHandles.end()) {
         // Load library
@@ -67,6 +174,10 @@ static void* searchSymbol(Z80Console& console, std::map<std::string, void*>& dlH
         auto handle = dlopen(path.c_str(), RTLD_NOW);
         if (NULL == handle) return NULL;
         dlHandles[lib] = handle;
+    }
+    if (!loader.libs.count(lib)) {
+        loader.libs.insert(lib);
+        auto handle = dlHandles[lib];
 
         // Register start handler if exist
         auto startHandler = dlsym(handle, "start");
@@ -87,6 +198,72 @@ static void* searchSymbol(Z80Console& console, std::map<std::string, void*>& dlH
     return fp;
 }
 
+// Push the standard input to the console on the background thread (-i async), stopped by the self-pipe before the console is deleted
+class ConsoleInputReader
+{
+  private:
+    Z80Console* console;
+    int stopPipe[2];
+    std::thread thread;
+
+    // wait until the fd is readable or the timeout (-1: infinite), returns false if the reader is stopping
+    bool wait(int fd, int timeoutMs)
+    {
+        struct pollfd fds[2];
+        fds[0].fd = stopPipe[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = fd;
+        fds[1].events = POLLIN;
+        while (poll(fds, 0 <= fd ? 2 : 1, timeoutMs) < 0) {
+            if (EINTR != errno) return false;
+        }
+        return !fds[0].revents;
+    }
+
+    void run()
+    {
+        char buf[4096];
+        while (wait(STDIN_FILENO, -1)) {
+            ssize_t size = read(STDIN_FILENO, buf, sizeof(buf));
+            if (size < 0 && EINTR == errno) continue;
+            if (size < 1) break;
+            for (int pushed = 0; pushed < size;) {
+                int n = console->pushConsoleInput(buf + pushed, (int)size - pushed);
+                if (n < 1 && !wait(-1, 1)) return; // wait for the guest to read the ring buffer
+                pushed += n;
+            }
+        }
+        console->closeConsoleInput();
+    }
+
+  public:
+    ConsoleInputReader()
+    {
+        console = NULL;
+        stopPipe[0] = -1;
+        stopPipe[1] = -1;
+    }
+
+    ~ConsoleInputReader() { stop(); }
+
+    bool start(Z80Console* console)
+    {
+        if (pipe(stopPipe) < 0) return false;
+        this->console = console;
+        thread = std::thread([this] { run(); });
+        return true;
+    }
+
+    void stop()
+    {
+        if (!thread.joinable()) return;
+        while (write(stopPipe[1], "", 1) < 0 && EINTR == errno) {}
+        thread.join();
+        close(stopPipe[0]);
+        close(stopPipe[1]);
+    }
+};
+
 static bool loadRom(Z80Console& console, const char* fileName)
 {
     FILE* fp = fopen(fileName, "rb");
@@ -144,44 +321,66 @@ static bool isdigitString(const char* str)
     return 0 < len;
 }
 
-static bool addPlugin(Z80Console& console, std::map<std::string, void*>& dlHandles, char* arg1, char* arg2, char* arg3)
+// the argument of -b (runs or runs:maxClocks)
+static bool isBenchRunsString(const char* str)
 {
-    bool isInput;
-    switch (arg1[0]) {
-        case 'i': isInput = true; break;
-        case 'o': isInput = false; break;
-        default:
-            fprintf(stderr, "error: Unknown plugin type (%s)\n", arg1);
-            printUsage();
-            return false;
+    const char* colon = strchr(str, ':');
+    if (!colon) return isdigitString(str);
+    return isdigitString(colon + 1) && isdigitString(std::string(str, colon - str).c_str());
+}
+
+static bool addPlugin(Z80Console& console, PluginLoader& loader, const char* arg1, const char* arg2, const char* arg3)
+{
+    char type = arg1[0];
+    bool isAsync = 0 == strcmp(arg1, "oa"); // output device processed on the worker thread
+    if (strcmp(arg1, "i") && strcmp(arg1, "o") && !isAsync && strcmp(arg1, "d")) {
+        fprintf(stderr, "error: Unknown plugin type (%s)\n", arg1);
+        printUsage();
+        return false;
     }
     unsigned char port = (unsigned char)hex2int(arg2);
-    char* lib = arg3;
-    char* symbol = strchr(lib, ':');
-    if (!symbol) {
+    std::string libName = arg3;
+    size_t colon = libName.find(':');
+    if (std::string::npos == colon) {
         fprintf(stderr, "error: Plugin symbol not specified (%s)\n", arg3);
         printUsage();
         return false;
     }
-    *symbol++ = '\0';
-    fprintf(stderr, "Loading %s from lib%s.so ... ", symbol, lib);
-    void* ptr = searchSymbol(console, dlHandles, lib, symbol);
+    const char* symbol = arg3 + colon + 1;
+    libName.resize(colon);
+    const char* lib = libName.c_str();
+    if (!loader.isQuiet) fprintf(stderr, strcmp(lib, "builtin") ? "Loading %s from lib%s.so ... " : "Loading %s from %s ... ", symbol, lib);
+    void* ptr = searchSymbol(console, loader, lib, symbol);
     if (!ptr) {
         fprintf(stderr, "error while loading symbol (%s:%s)\n", lib, symbol);
-        perror("Reason");
+        if (strcmp(lib, "builtin")) perror("Reason");
         return false;
-    } else {
+    } else if (!loader.isQuiet) {
         fprintf(stderr, "succeed\n");
     }
-    if (isInput) {
+    if ('d' == type) {
+        Z80ConsoleDevice device;
+        memset(&device, 0, sizeof(device));
+        device.version = Z80CONSOLE_DEVICE_VERSION;
+        if (0 != ((Z80ConsoleDeviceInit)ptr)(&device)) {
+            fprintf(stderr, "error: Device initialization failed (%s:%s)\n", lib, symbol);
+            return false;
+        }
+        if (!console.addDevice(port, &device)) {
+            fprintf(stderr, "error: Unsupported device version (%s:%s version %d)\n", lib, symbol, device.version);
+            if (device.destroy) device.destroy(device.userData);
+            return false;
+        }
+    } else if ('i' == type) {
         console.addInputDevice(port, (unsigned char (*)(void*, unsigned char))ptr);
     } else {
         console.addOutputDevice(port, (void (*)(void*, unsigned char, unsigned char))ptr);
+        console.setOutputDeviceAsync(port, isAsync);
     }
     return true;
 }
 
-static bool addMemoryMap(Z80Console& console, std::map<std::string, void*>& dlHandles, char* arg1, char* arg2, char* arg3)
+static bool addMemoryMap(Z80Console& console, PluginLoader& loader, const char* arg1, const char* arg2, const char* arg3)
 {
     bool isInput;
     switch (arg1[0]) {
@@ -192,38 +391,249 @@ static bool addMemoryMap(Z80Console& console, std::map<std::string, void*>& dlHa
             printUsage();
             return false;
     }
+    const char* accessType = arg1 + 1; // "": byte, "16": word, "b": block
+    if (strcmp(accessType, "") && strcmp(accessType, "16") && strcmp(accessType, "b")) {
+        fprintf(stderr, "error: Unknown mmap type (%s)\n", arg1);
+        printUsage();
+        return false;
+    }
     unsigned short addr = hex2int(arg2) & 0xFF;
     addr <<= 8;
-    char* lib = arg3;
-    char* symbol = strchr(lib, ':');
-    if (!symbol) {
+    std::string libName = arg3;
+    size_t colon = libName.find(':');
+    if (std::string::npos == colon) {
         fprintf(stderr, "error: mmap symbol not specified (%s)\n", arg3);
         printUsage();
         return false;
     }
-    *symbol++ = '\0';
-    fprintf(stderr, "Loading %s from lib%s.so ... ", symbol, lib);
-    void* ptr = searchSymbol(console, dlHandles, lib, symbol);
+    const char* symbol = arg3 + colon + 1;
+    libName.resize(colon);
+    const char* lib = libName.c_str();
+    if (!loader.isQuiet) fprintf(stderr, strcmp(lib, "builtin") ? "Loading %s from lib%s.so ... " : "Loading %s from %s ... ", symbol, lib);
+    void* ptr = searchSymbol(console, loader, lib, symbol);
     if (!ptr) {
         fprintf(stderr, "error while loading symbol (%s:%s)\n", lib, symbol);
-        fprintf(stderr, "Reason: %s\n", dlerror());
+        if (strcmp(lib, "builtin")) fprintf(stderr, "Reason: %s\n", dlerror());
         return false;
-    } else {
+    } else if (!loader.isQuiet) {
         fprintf(stderr, "succeed\n");
     }
     if (isInput) {
-        console.addReadMemoryMap(addr, (unsigned char (*)(void*, unsigned short))ptr);
+        if (0 == strcmp(accessType, "16")) {
+            console.addReadMemoryMap16(addr, (unsigned short (*)(void*, unsigned short))ptr);
+        } else if (0 == strcmp(accessType, "b")) {
+            console.addReadBlockMemoryMap(addr, (void (*)(void*, unsigned short, unsigned char*, unsigned short))ptr);
+        } else {
+            console.addReadMemoryMap(addr, (unsigned char (*)(void*, unsigned short))ptr);
+        }
     } else {
-        console.addWriteMemoryMap(addr, (void (*)(void*, unsigned short, unsigned char))ptr);
+        if (0 == strcmp(accessType, "16")) {
+            console.addWriteMemoryMap16(addr, (void (*)(void*, unsigned short, unsigned short))ptr);
+        } else if (0 == strcmp(accessType, "b")) {
+            console.addWriteBlockMemoryMap(addr, (void (*)(void*, unsigned short, const unsigned char*, unsigned short))ptr);
+        } else {
+            console.addWriteMemoryMap(addr, (void (*)(void*, unsigned short, unsigned char))ptr);
+        }
     }
     return true;
 }
 
-int main(int argc, char* argv[])
+// Host utilisation of the quanta (the execution slices between the pacing)
+class QuantumStats
 {
-    Z80Console console;
-    std::map<std::string, void*> dlHandles;
+  private:
+    struct Counters {
+        unsigned long long quanta;
+        unsigned long long busyNs; // host time spent in the emulation
+        unsigned long long maxBusyNs;
+        unsigned long long idleNs; // host time waiting for the deadline
+        unsigned long long overruns; // the quanta finished after the deadline
+    } interval, total;
+    unsigned long long intervalStartNs;
+
+    void print(const char* label, Counters* counters)
+    {
+        unsigned long long hostNs = counters->busyNs + counters->idleNs;
+        fprintf(stderr, "%s: %llu quanta, busy %.1f%% (avg %llu us, max %llu us), idle %.1f%%, overruns %llu\n",
+                label,
+                counters->quanta,
+                hostNs ? counters->busyNs * 100.0 / hostNs : 0.0,
+                counters->quanta ? counters->busyNs / counters->quanta / 1000 : 0,
+                counters->maxBusyNs / 1000,
+                hostNs ? counters->idleNs * 100.0 / hostNs : 0.0,
+                counters->overruns);
+    }
+
+    static void add(Counters* counters, unsigned long long busyNs, unsigned long long idleNs, bool isOverrun)
+    {
+        counters->quanta++;
+        counters->busyNs += busyNs;
+        if (counters->maxBusyNs < busyNs) counters->maxBusyNs = busyNs;
+        counters->idleNs += idleNs;
+        if (isOverrun) counters->overruns++;
+    }
+
+  public:
+    QuantumStats()
+    {
+        memset(&interval, 0, sizeof(interval));
+        memset(&total, 0, sizeof(total));
+        intervalStartNs = monotonicNs();
+    }
+
+    // print the statistics of each second if isPeriodic
+    void add(unsigned long long busyNs, unsigned long long idleNs, bool isOverrun, bool isPeriodic)
+    {
+        add(&interval, busyNs, idleNs, isOverrun);
+        add(&total, busyNs, idleNs, isOverrun);
+        unsigned long long now = monotonicNs();
+        if (1000000000ULL <= now - intervalStartNs) {
+            if (isPeriodic) print("Quantum", &interval);
+            memset(&interval, 0, sizeof(interval));
+            intervalStartNs = now;
+        }
+    }
+
+    void printTotal() { print("Quantum (total)", &total); }
+};
+
+#define BENCH_WARMUP_RUNS 1
+
+// the value at the percentile (nearest rank)
+static double percentile(std::vector<double> values, int percent)
+{
+    std::sort(values.begin(), values.end());
+    size_t rank = (values.size() * percent + 99) / 100;
+    return values[0 < rank ? rank - 1 : 0];
+}
+
+// Execute the program from the reset (to the end or maxClocks) without the console I/O and the pacing, and print the statistics of the runs
+static int runBenchmark(Z80Console& console, int runs, unsigned long long maxClocks, bool isJson)
+{
+    int nullFd = open("/dev/null", O_RDWR);
+    if (nullFd < 0) {
+        perror("error: Cannot open /dev/null");
+        return -1;
+    }
+    FdConsoleSink nullSink(nullFd);
+    FdConsoleSource nullSource(nullFd);
+    console.setConsoleSink(&nullSink);
+    console.setConsoleSource(&nullSource);
+    console.setConsoleOutputBuffer(0x100000, false);
+    std::vector<double> wallMs, mhz, mips, nsPerInstruction;
+    unsigned long long clocks = 0;
+    unsigned long long instructions = 0;
+    for (int i = -BENCH_WARMUP_RUNS; i < runs; i++) {
+        console.reset();
+        unsigned long long startNs = monotonicNs();
+        while (!console.isEnded() && (!maxClocks || console.cpu->getClockCount() < maxClocks)) {
+            unsigned long long remain = maxClocks ? maxClocks - console.cpu->getClockCount() : DEFAULT_CLOCK_RATE;
+            console.execute(remain < DEFAULT_CLOCK_RATE ? (int)remain : DEFAULT_CLOCK_RATE);
+        }
+        console.flushConsoleOutput();
+        unsigned long long elapsedNs = monotonicNs() - startNs;
+        if (i < 0) continue; // warm-up
+        clocks = console.cpu->getClockCount();
+        instructions = console.cpu->getInstructionCount();
+        if (!elapsedNs) elapsedNs = 1;
+        wallMs.push_back(elapsedNs / 1000000.0);
+        mhz.push_back(clocks * 1000.0 / elapsedNs);
+        mips.push_back(instructions * 1000.0 / elapsedNs);
+        nsPerInstruction.push_back(instructions ? (double)elapsedNs / instructions : 0.0);
+    }
+    console.setConsoleSink(NULL);
+    console.setConsoleSource(NULL);
+    close(nullFd);
+
+    const char* names[4] = {"wall_ms", "mhz", "mips", "ns_per_instruction"};
+    std::vector<double>* values[4] = {&wallMs, &mhz, &mips, &nsPerInstruction};
+    if (isJson) {
+        printf("{\"runs\": %d, \"warmup\": %d, \"clocks\": %llu, \"instructions\": %llu", runs, BENCH_WARMUP_RUNS, clocks, instructions);
+        for (int i = 0; i < 4; i++) {
+            printf(", \"%s\": {\"median\": %.3f, \"p90\": %.3f, \"min\": %.3f, \"max\": %.3f}",
+                   names[i],
+                   percentile(*values[i], 50),
+                   percentile(*values[i], 90),
+                   percentile(*values[i], 0),
+                   percentile(*values[i], 100));
+        }
+        printf("}\n");
+    } else {
+        printf("Benchmark: %d runs (+%d warm-up), %llu clocks, %llu instructions per run\n", runs, BENCH_WARMUP_RUNS, clocks, instructions);
+        printf("%-20s %12s %12s %12s %12s\n", "", "median", "p90", "min", "max");
+        for (int i = 0; i < 4; i++) {
+            printf("%-20s %12.3f %12.3f %12.3f %12.3f\n",
+                   names[i],
+                   percentile(*values[i], 50),
+                   percentile(*values[i], 90),
+                   percentile(*values[i], 0),
+                   percentile(*values[i], 100));
+        }
+    }
+    return console.getReturnCode();
+}
+
+// Command line options except the console configurations (plugins, memory maps, RAM banks, trace and ROM files)
+struct Options {
+    bool isTrace = false;
+    bool isTraceStdout = false;
+    TraceFilter traceFilter;
+    bool isAsyncInput = false;
+    bool isProfiling = false;
+    long clockRate = 0; // 0: not paced
+    long quantumClocks = 0;
+    long quantumHz = 0;
+    bool isQuantumStats = false;
+    int benchRuns = 0; // 0: not the benchmark mode
+    unsigned long long benchMaxClocks = 0;
+    bool isBenchJson = false;
+    int threads = 0;
+    const char* batchFile = NULL;   // NULL: not the batch mode
+    const char* serveSocket = NULL; // NULL: not the server mode
+    bool isForkServer = false;
+    int checkpointPc = -1;                  // -1: none
+    unsigned long long checkpointCycle = 0; // 0: none
+    unsigned long long maxCycles = 0;       // 0: unlimited
+    unsigned long long maxInstructions = 0; // 0: unlimited
+    unsigned long long timeoutMs = 0;       // 0: unlimited
+    const char* statsFile = NULL;           // NULL: none, "-": stdout
+    const char* consoleOnlyOption = NULL;   // the last option only for the console mode (-c, -q, -i, -b, -P), rejected by the batch mode
+};
+
+// Parse the filters following -v (pc=start-end, bank=number, count=[from-]to), and advance i to the last one
+static bool parseTraceFilter(TraceFilter& filter, int argc, char* argv[], int& i)
+{
+    while (i + 1 < argc) {
+        const char* arg = argv[i + 1];
+        const char* range = strchr(arg, '-');
+        if (0 == strncmp(arg, "pc=", 3)) {
+            if (!range) {
+                fprintf(stderr, "error: Invalid PC range (%s)\n", arg);
+                return false;
+            }
+            filter.pcStart = (int)strtol(arg + 3, NULL, 16) & 0xFFFF;
+            filter.pcEnd = (int)strtol(range + 1, NULL, 16) & 0xFFFF;
+        } else if (0 == strncmp(arg, "bank=", 5) && isdigitString(arg + 5)) {
+            filter.bank = atoi(arg + 5) & 0xFF;
+        } else if (0 == strncmp(arg, "count=", 6)) {
+            filter.from = range ? strtoull(arg + 6, NULL, 10) : 1;
+            filter.to = strtoull(range ? range + 1 : arg + 6, NULL, 10);
+            if (filter.from < 1 || filter.to < filter.from) {
+                fprintf(stderr, "error: Invalid instruction count (%s)\n", arg);
+                return false;
+            }
+        } else {
+            break;
+        }
+        i++;
+    }
+    return true;
+}
 
+// Configure the console by the command line (called for each console of the batch workers)
+static bool parseArguments(Z80Console& console, Options& options, PluginLoader& loader, int argc, char* argv[])
+{
+    options = Options();
     for (int i = 1; i < argc; i++) {
         if ('-' == argv[i][0]) {
             switch (argv[i][1]) {
@@ -231,10 +641,10 @@ int main(int argc, char* argv[])
                     if (argc <= i + 3) {
                         fprintf(stderr, "error: Missing argument for -p option\n");
                         printUsage();
-                        return -1;
+                        return false;
                     }
-                    if (!addPlugin(console, dlHandles, argv[i + 1], argv[i + 2], argv[i + 3])) {
-                        return -1;
+                    if (!addPlugin(console, loader, argv[i + 1], argv[i + 2], argv[i + 3])) {
+                        return false;
                     }
                     i += 3;
                     break;
@@ -243,10 +653,10 @@ int main(int argc, char* argv[])
                     if (argc <= i + 3) {
                         fprintf(stderr, "error: Missing argument for -m option\n");
                         printUsage();
-                        return -1;
+                        return false;
                     }
-                    if (!addMemoryMap(console, dlHandles, argv[i + 1], argv[i + 2], argv[i + 3])) {
-                        return -1;
+                    if (!addMemoryMap(console, loader, argv[i + 1], argv[i + 2], argv[i + 3])) {
+                        return false;
                     }
                     i += 3;
                     break;
@@ -255,7 +665,7 @@ int main(int argc, char* argv[])
                     if (argc <= i + 1) {
                         fprintf(stderr, "error: Missing argument for -r option\n");
                         printUsage();
-                        return -1;
+                        return false;
                     }
                     i++;
                     int ramStart = atoi(argv[i]);
@@ -279,54 +689,995 @@ int main(int argc, char* argv[])
                             isStdout = false;
                         }
                     }
-                    if (isStdout) {
-                        console.cpu->setDebugMessage([](void* arg, const char* msg) {
-                            puts(msg);
-                        });
-                    } else {
-                        console.cpu->setDebugMessage([](void* arg, const char* msg) {
-                            fprintf(stderr, "%s\n", msg);
-                        });
-                    }
+                    options.isTrace = true;
+                    options.isTraceStdout = isStdout;
+                    if (!parseTraceFilter(options.traceFilter, argc, argv, i)) return false;
                     break;
                 }
                 case 'c': {
+                    options.consoleOnlyOption = "-c";
+                    long clockRate = DEFAULT_CLOCK_RATE;
                     if (i + 1 < argc && isdigitString(argv[i + 1])) {
                         i++;
                         clockRate = atol(argv[i]);
+                    }
+                    if (0 < clockRate && clockRate < 1000) {
+                        fprintf(stderr, "error: The clock rate must be at least 1000 Hz.\n");
+                        return false;
+                    }
+                    options.clockRate = clockRate;
+                    break;
+                }
+                case 'i': {
+                    options.consoleOnlyOption = "-i";
+                    if (argc <= i + 1) {
+                        fprintf(stderr, "error: Missing argument for -i option\n");
+                        printUsage();
+                        return false;
+                    }
+                    i++;
+                    if (0 == strcmp(argv[i], "sync")) {
+                        options.isAsyncInput = false;
+                    } else if (0 == strcmp(argv[i], "async")) {
+                        options.isAsyncInput = true;
                     } else {
-                        clockRate = DEFAULT_CLOCK_RATE;
+                        fprintf(stderr, "error: Unknown input mode (%s)\n", argv[i]);
+                        printUsage();
+                        return false;
                     }
-                    clockRateM = clockRate / 1000;
-                    if (0 < clockRate) {
-                        if (clockRateM < 1) {
-                            fprintf(stderr, "error: The clock rate must be at least 1000 Hz.\n");
-                            return -1;
-                        }
-                        console.cpu->setConsumeClockCallback(consumeClock);
+                    break;
+                }
+                case 'q': {
+                    options.consoleOnlyOption = "-q";
+                    if (argc <= i + 1 || !isdigit(argv[i + 1][0])) {
+                        fprintf(stderr, "error: Missing argument for -q option\n");
+                        printUsage();
+                        return false;
+                    }
+                    i++;
+                    char* unit;
+                    long value = strtol(argv[i], &unit, 10);
+                    if (0 == strcasecmp(unit, "hz")) {
+                        options.quantumHz = value;
+                        options.quantumClocks = 0;
+                    } else if (!*unit) {
+                        options.quantumHz = 0;
+                        options.quantumClocks = value;
                     } else {
-                        console.cpu->setConsumeClockCallback(NULL);
+                        value = 0;
+                    }
+                    if (value < 1) {
+                        fprintf(stderr, "error: Invalid quantum (%s)\n", argv[i]);
+                        printUsage();
+                        return false;
+                    }
+                    if (i + 1 < argc && 0 == strcmp(argv[i + 1], "stats")) {
+                        i++;
+                        options.isQuantumStats = true;
                     }
                     break;
                 }
+                case 'b': {
+                    options.consoleOnlyOption = "-b";
+                    options.benchRuns = 5;
+                    if (i + 1 < argc && isBenchRunsString(argv[i + 1])) {
+                        i++;
+                        char* maxClocks;
+                        options.benchRuns = (int)strtol(argv[i], &maxClocks, 10);
+                        if (':' == *maxClocks) options.benchMaxClocks = strtoull(maxClocks + 1, NULL, 10);
+                        if (options.benchRuns < 1) {
+                            fprintf(stderr, "error: Invalid number of the benchmark runs (%s)\n", argv[i]);
+                            return false;
+                        }
+                    }
+                    if (i + 1 < argc && 0 == strcmp(argv[i + 1], "json")) {
+                        i++;
+                        options.isBenchJson = true;
+                    }
+                    break;
+                }
+                case 'P': {
+                    options.consoleOnlyOption = "-P";
+                    options.isProfiling = true;
+                    console.setProfiling(true);
+                    break;
+                }
+                case 'j': {
+                    if (argc <= i + 1 || !isdigitString(argv[i + 1]) || atoi(argv[i + 1]) < 1) {
+                        fprintf(stderr, "error: Missing argument for -j option\n");
+                        printUsage();
+                        return false;
+                    }
+                    options.threads = atoi(argv[++i]);
+                    break;
+                }
+                case '-': {
+                    if (0 == strcmp(argv[i], "--batch") && i + 1 < argc) {
+                        options.batchFile = argv[++i];
+                        break;
+                    }
+                    if (0 == strcmp(argv[i], "--serve") && i + 1 < argc) {
+                        options.serveSocket = argv[++i];
+                        break;
+                    }
+                    if (0 == strcmp(argv[i], "--fork-server")) {
+                        options.isForkServer = true;
+                        if (i + 1 < argc && 0 == strncmp(argv[i + 1], "pc=", 3)) {
+                            options.checkpointPc = hex2int(argv[++i] + 3) & 0xFFFF;
+                        } else if (i + 1 < argc && 0 == strncmp(argv[i + 1], "cycle=", 6)) {
+                            options.checkpointCycle = strtoull(argv[++i] + 6, NULL, 10);
+                        }
+                        break;
+                    }
+                    if (0 == strncmp(argv[i], "--stats=", 8) && argv[i][8]) {
+                        options.statsFile = argv[i] + 8;
+                        break;
+                    }
+                    if ((0 == strcmp(argv[i], "--max-cycles") || 0 == strcmp(argv[i], "--max-instructions") || 0 == strcmp(argv[i], "--timeout-ms")) && i + 1 < argc) {
+                        if (!isdigitString(argv[i + 1])) {
+                            fprintf(stderr, "error: Invalid limit (%s %s)\n", argv[i], argv[i + 1]);
+                            return false;
+                        }
+                        unsigned long long limit = strtoull(argv[i + 1], NULL, 10);
+                        if ('c' == argv[i][6]) {
+                            options.maxCycles = limit;
+                        } else if ('i' == argv[i][6]) {
+                            options.maxInstructions = limit;
+                        } else {
+                            options.timeoutMs = limit;
+                        }
+                        i++;
+                        break;
+                    }
+                    fprintf(stderr, "error: Unknown argument (%s)\n", argv[i]);
+                    printUsage();
+                    return false;
+                }
                 default:
                     fprintf(stderr, "error: Unknown argument (%s)\n", argv[i]);
                     printUsage();
-                    return -1;
+                    return false;
             }
         } else {
-            if (!loadRom(console, argv[i])) return -1;
+            if (!loadRom(console, argv[i])) return false;
+        }
+    }
+    return true;
+}
+
+// A job of the batch mode: ROM files and an input file (a line of the batch file: "rom.bin [rom2.bin...] [< input.txt] [max-clocks=N]")
+struct BatchJob {
+    std::vector<std::string> roms;
+    std::string input;
+    unsigned long long maxClocks; // 0: unlimited
+    std::string error;            // the error loading the files
+    bool isEnded;                 // false: stopped by an invalid instruction or the limit
+    bool isLimit;                 // reached the limit
+    int returnCode;
+    unsigned long long clocks;
+    std::vector<unsigned char> output;
+};
+
+static bool readFile(const char* fileName, std::vector<unsigned char>& data)
+{
+    FILE* fp = fopen(fileName, "rb");
+    if (!fp) return false;
+    unsigned char buf[4096];
+    size_t size;
+    data.clear();
+    while (0 < (size = fread(buf, 1, sizeof(buf), fp))) data.insert(data.end(), buf, buf + size);
+    fclose(fp);
+    return true;
+}
+
+static bool loadBatchJobs(const char* fileName, std::vector<BatchJob>& jobs)
+{
+    FILE* fp = fopen(fileName, "r");
+    if (!fp) {
+        fprintf(stderr, "error: Batch file not found (%s)\n", fileName);
+        return false;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), fp)) {
+        if ('#' == line[0]) continue;
+        BatchJob job;
+        job.maxClocks = 0;
+        bool isInput = false;
+        for (char* token = strtok(line, " \t\r\n"); token; token = strtok(NULL, " \t\r\n")) {
+            if (0 == strncmp(token, "max-clocks=", 11)) {
+                job.maxClocks = strtoull(token + 11, NULL, 10);
+                continue;
+            }
+            if ('<' == token[0]) {
+                isInput = true;
+                if (!token[1]) continue;
+                token++;
+            }
+            if (isInput) {
+                job.input = token;
+                isInput = false;
+            } else {
+                job.roms.push_back(token);
+            }
+        }
+        if (!job.roms.empty()) jobs.push_back(job);
+    }
+    fclose(fp);
+    return true;
+}
+
+static std::atomic<bool> serverStopRequested(false); // read by the threads of the connections (lock-free, so it is also safe in the signal handler)
+static int serverStopPipe[2] = {-1, -1}; // written by the signal handler to wake up the server waiting for the connections
+
+static void requestServerStop(int signal)
+{
+    int savedErrno = errno;
+    serverStopRequested = true;
+    if (0 <= serverStopPipe[1]) {
+        ssize_t result = write(serverStopPipe[1], "", 1);
+        (void)result;
+    }
+    errno = savedErrno;
+}
+
+// The limits of a job in the batch and the server modes (0: unlimited, --max-cycles, --max-instructions and --timeout-ms)
+struct JobLimits {
+    unsigned long long maxClocks;
+    unsigned long long maxInstructions;
+    unsigned long long timeoutMs;
+};
+
+// Execute the program loaded to the console (after reset) with the input until it ends, stops by an invalid instruction,
+// reaches a limit or the server is stopping, and capture the console output to the sink (used by the batch and the server
+// modes), returns true if the job has reached a limit
+static bool executeJob(Z80Console* console, MemoryConsoleSink* sink, const unsigned char* input, int inputSize, const JobLimits& limits)
+{
+    MemoryConsoleSource source(input, inputSize);
+    sink->clear();
+    console->setConsoleSink(sink);
+    console->setConsoleSource(&source);
+    console->setBudget(limits.maxClocks, limits.maxInstructions);
+    unsigned long long deadlineNs = limits.timeoutMs ? monotonicNs() + limits.timeoutMs * 1000000ULL : 0;
+    int slice = deadlineNs ? DEFAULT_CLOCK_RATE / 1000 : DEFAULT_CLOCK_RATE; // check the timeout per 1ms of the emulated clock
+    bool isTimedOut = false;
+    while (!console->isEnded() && !console->isBudgetExhausted() && !serverStopRequested) {
+        if (console->execute(slice) < 1 && !console->isBudgetExhausted()) break;
+        if (deadlineNs && deadlineNs <= monotonicNs() && !console->isEnded()) {
+            isTimedOut = true;
+            break;
+        }
+    }
+    bool isLimit = isTimedOut || (!console->isEnded() && console->isBudgetExhausted());
+    console->setBudget(0, 0);
+    console->flushConsoleOutput();
+    console->setConsoleSink(NULL);
+    console->setConsoleSource(NULL);
+    return isLimit;
+}
+
+// Execute the jobs taken from the shared index until no job remains (the console is reused by resetting it)
+// The job queues of the batch workers: each worker takes the jobs from the front of its own queue,
+// and steals from the back of the other queues after its own queue becomes empty
+class BatchQueues
+{
+  private:
+    struct Queue {
+        std::deque<size_t> jobs;
+        std::mutex mutex;
+    };
+    std::vector<Queue> queues;
+
+  public:
+    // split the jobs into the contiguous ranges of the workers
+    BatchQueues(int workers, size_t jobs) : queues(workers)
+    {
+        for (size_t i = 0; i < jobs; i++) queues[i * workers / jobs].jobs.push_back(i);
+    }
+
+    bool pop(int worker, size_t* index)
+    {
+        for (int i = 0; i < (int)queues.size(); i++) {
+            auto queue = &queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            if (queue->jobs.empty()) continue;
+            if (0 == i) {
+                *index = queue->jobs.front();
+                queue->jobs.pop_front();
+            } else {
+                *index = queue->jobs.back();
+                queue->jobs.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+};
+
+static void runBatchWorker(Z80Console* console, std::vector<BatchJob>* jobs, BatchQueues* queues, int worker, const JobLimits* defaultLimits)
+{
+    MemoryConsoleSink sink;
+    std::vector<unsigned char> data;
+    std::vector<unsigned char> input;
+    size_t index;
+    while (queues->pop(worker, &index)) {
+        auto job = &(*jobs)[index];
+        console->reset();
+        console->clearRomData();
+        for (auto& rom : job->roms) {
+            if (!readFile(rom.c_str(), data)) {
+                job->error = "ROM file not found (" + rom + ")";
+                break;
+            }
+            console->addRomData(data.data(), (int)data.size());
+        }
+        input.clear();
+        if (job->error.empty() && !job->input.empty() && !readFile(job->input.c_str(), input)) {
+            job->error = "Input file not found (" + job->input + ")";
+        }
+        if (!job->error.empty()) continue;
+        JobLimits limits = *defaultLimits;
+        if (job->maxClocks) limits.maxClocks = job->maxClocks;
+        job->isLimit = executeJob(console, &sink, input.data(), (int)input.size(), limits);
+        job->isEnded = console->isEnded();
+        job->returnCode = console->getReturnCode();
+        job->clocks = console->cpu->getClockCount();
+        job->output.assign(sink.getData(), sink.getData() + sink.getSize());
+    }
+}
+
+static void printJsonString(const unsigned char* data, size_t size)
+{
+    putchar('"');
+    for (size_t i = 0; i < size; i++) {
+        switch (data[i]) {
+            case '"': fputs("\\\"", stdout); break;
+            case '\\': fputs("\\\\", stdout); break;
+            case '\n': fputs("\\n", stdout); break;
+            case '\r': fputs("\\r", stdout); break;
+            case '\t': fputs("\\t", stdout); break;
+            default:
+                if (data[i] < 0x20 || 0x7F <= data[i]) {
+                    printf("\\u%04X", data[i]); // a byte (not UTF-8) as U+0000 ~ U+00FF
+                } else {
+                    putchar(data[i]);
+                }
+        }
+    }
+    putchar('"');
+}
+
+// Execute the jobs of the batch file on the worker threads (each has a console configured by the command line),
+// and print the result of each job in JSON lines (in order of the batch file)
+static int runBatch(Options& options, int argc, char* argv[], std::map<std::string, void*>& dlHandles)
+{
+    if (options.isTrace) {
+        fprintf(stderr, "error: -v is not supported in the batch mode\n");
+        return -1;
+    }
+    if (options.consoleOnlyOption) {
+        fprintf(stderr, "error: %s is not supported in the batch mode\n", options.consoleOnlyOption);
+        return -1;
+    }
+    std::vector<BatchJob> jobs;
+    if (!loadBatchJobs(options.batchFile, jobs)) return -1;
+    int threads = options.threads ? options.threads : (int)std::thread::hardware_concurrency();
+    if (threads < 1) threads = 1;
+    if ((int)jobs.size() < threads) threads = jobs.empty() ? 1 : (int)jobs.size();
+
+    std::vector<Z80Console*> consoles;
+    int returnCode = 0;
+    for (int i = 0; i < threads; i++) {
+        auto console = new Z80Console();
+        consoles.push_back(console);
+        Options workerOptions;
+        PluginLoader loader;
+        loader.dlHandles = &dlHandles;
+        loader.isQuiet = true;
+        if (!parseArguments(*console, workerOptions, loader, argc, argv)) {
+            returnCode = -1;
+            break;
+        }
+        console->setConsoleInputMode(false, false); // the input is the file of the job (no prompt in the output)
+        if (console->getRomCount()) {
+            fprintf(stderr, "error: ROM files must be specified in the batch file\n");
+            returnCode = -1;
+            break;
+        }
+    }
+    if (0 == returnCode) {
+        fprintf(stderr, "Start %d jobs on %d threads\n", (int)jobs.size(), threads);
+        unsigned long long startNs = monotonicNs();
+        BatchQueues queues(threads, jobs.size());
+        std::vector<std::thread> workers;
+        JobLimits limits = {options.maxCycles, options.maxInstructions, options.timeoutMs};
+        for (int i = 0; i < threads; i++) workers.push_back(std::thread(runBatchWorker, consoles[i], &jobs, &queues, i, &limits));
+        for (auto& worker : workers) worker.join();
+        unsigned long long elapsedNs = monotonicNs() - startNs;
+        for (size_t i = 0; i < jobs.size(); i++) {
+            auto job = &jobs[i];
+            printf("{\"job\": %d, \"rom\": ", (int)i + 1);
+            printJsonString((const unsigned char*)job->roms[0].c_str(), job->roms[0].size());
+            if (!job->error.empty()) {
+                printf(", \"error\": ");
+                printJsonString((const unsigned char*)job->error.c_str(), job->error.size());
+                returnCode = 1;
+            } else {
+                printf(", \"ended\": %s, \"limit\": %s, \"code\": %d, \"clocks\": %llu, \"output\": ", job->isEnded ? "true" : "false", job->isLimit ? "true" : "false", job->returnCode, job->clocks);
+                printJsonString(job->output.data(), job->output.size());
+                if (!job->isEnded) returnCode = 1;
+            }
+            printf("}\n");
+        }
+        fprintf(stderr, "%d jobs have been ended in %llu ms (%s)\n", (int)jobs.size(), elapsedNs / 1000000, returnCode ? "with errors" : "no errors");
+    }
+    for (auto console : consoles) delete console;
+    return returnCode;
+}
+
+// The consoles of the server mode: configured once by the command line, and reused for the requests
+class ConsolePool
+{
+  private:
+    struct Entry {
+        Z80Console* console;
+        const std::vector<unsigned char>* rom; // the ROM loaded to the console
+    };
+    std::vector<Entry> idle;
+    std::mutex mutex;
+    std::condition_variable available;
+
+  public:
+    void add(Z80Console* console) { idle.push_back({console, NULL}); }
+
+    // wait for an idle console, and load the ROM unless it is already loaded
+    Z80Console* acquire(const std::vector<unsigned char>* rom)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        available.wait(lock, [this] { return !idle.empty(); });
+        auto entry = idle.back();
+        for (size_t i = 0; i < idle.size(); i++) {
+            if (idle[i].rom == rom) {
+                entry = idle[i];
+                idle[i] = idle.back();
+                break;
+            }
+        }
+        idle.pop_back();
+        lock.unlock();
+        entry.console->reset();
+        if (entry.rom != rom) {
+            entry.console->clearRomData();
+            entry.console->addRomData(rom->data(), (int)rom->size());
+        }
+        return entry.console;
+    }
+
+    void release(Z80Console* console, const std::vector<unsigned char>* rom)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        idle.push_back({console, rom});
+        available.notify_one();
+    }
+
+    void deleteAll()
+    {
+        for (auto& entry : idle) delete entry.console;
+        idle.clear();
+    }
+};
+
+// The ROM files read once by the server (never removed while the server is running)
+class RomCache
+{
+  private:
+    std::map<std::string, std::vector<unsigned char>> roms;
+    std::mutex mutex;
+
+  public:
+    const std::vector<unsigned char>* get(const std::string& fileName)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto itr = roms.find(fileName);
+        if (itr != roms.end()) return &itr->second;
+        std::vector<unsigned char> data;
+        if (!readFile(fileName.c_str(), data) || data.empty()) return NULL;
+        return &(roms[fileName] = data);
+    }
+};
+
+// Buffered reader of a connection
+class SocketReader
+{
+  private:
+    int fd;
+    char buffer[4096];
+    int position;
+    int length;
+
+    bool fill()
+    {
+        ssize_t size;
+        do {
+            size = read(fd, buffer, sizeof(buffer));
+        } while (size < 0 && EINTR == errno);
+        if (size < 1) return false;
+        position = 0;
+        length = (int)size;
+        return true;
+    }
+
+  public:
+    SocketReader(int fd)
+    {
+        this->fd = fd;
+        position = 0;
+        length = 0;
+    }
+
+    bool readLine(std::string& line)
+    {
+        line.clear();
+        while (true) {
+            if (position == length && !fill()) return false;
+            char c = buffer[position++];
+            if ('\n' == c) return true;
+            if (4096 <= line.size()) return false;
+            line += c;
+        }
+    }
+
+    bool readBytes(std::vector<unsigned char>& data, size_t size)
+    {
+        data.clear();
+        while (data.size() < size) {
+            if (position == length && !fill()) return false;
+            size_t n = length - position < (int)(size - data.size()) ? length - position : size - data.size();
+            data.insert(data.end(), buffer + position, buffer + position + n);
+            position += (int)n;
+        }
+        return true;
+    }
+};
+
+static bool writeFully(int fd, const void* data, size_t size)
+{
+    for (size_t written = 0; written < size;) {
+        ssize_t result = write(fd, (const char*)data + written, size - written);
+        if (result < 0 && EINTR == errno) continue;
+        if (result < 1) return false;
+        written += result;
+    }
+    return true;
+}
+
+static bool writeResponse(int fd, const char* status, int code, unsigned long long clocks, const void* data, size_t size)
+{
+    char header[128];
+    int length = snprintf(header, sizeof(header), "%s %d %llu %u\n", status, code, clocks, (unsigned int)size);
+    return writeFully(fd, header, length) && writeFully(fd, data, size);
+}
+
+// The connections of the server, each processed on its own thread (joined after the connection is closed, or at the shutdown)
+class ServerConnections
+{
+  private:
+    struct Connection {
+        int fd;
+        bool isClosed;
+        std::thread thread;
+    };
+    std::list<Connection> connections;
+    std::mutex mutex;
+
+    // join the threads of the connections (only the closed ones, or all after shutting down the open ones)
+    void join(bool isAll)
+    {
+        std::vector<std::thread> threads;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto itr = connections.begin(); connections.end() != itr;) {
+                if (!isAll && !itr->isClosed) {
+                    itr++;
+                    continue;
+                }
+                if (!itr->isClosed) shutdown(itr->fd, SHUT_RDWR); // wake up the thread waiting for the request of an idle client
+                threads.push_back(std::move(itr->thread));
+                itr = itr->isClosed ? connections.erase(itr) : std::next(itr);
+            }
+        }
+        for (auto& thread : threads) thread.join();
+        if (isAll) {
+            std::lock_guard<std::mutex> lock(mutex);
+            connections.clear(); // all the threads are ended
+        }
+    }
+
+  public:
+    ~ServerConnections() { shutdownAll(); }
+
+    // process the connection by serve(fd) on a new thread (the fd is closed after serve returns)
+    void start(int fd, std::function<void(int)> serve)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        connections.push_back(Connection());
+        auto connection = &connections.back();
+        connection->fd = fd;
+        connection->isClosed = false;
+        connection->thread = std::thread([this, connection, serve] {
+            serve(connection->fd);
+            std::lock_guard<std::mutex> lock(mutex);
+            close(connection->fd);
+            connection->isClosed = true;
+        });
+    }
+
+    void joinClosed() { join(false); }
+    void shutdownAll() { join(true); }
+};
+
+/**
+ * Process the requests of a connection (until it is closed by the client or shut down by the server)
+ *   request:  "rom-file max-clocks input-size\n" + input (input-size bytes)
+ *   response: "{ended|limit|invalid|error} return-code clocks output-size\n" + console output (or error message)
+ */
+static void serveConnection(int fd, ConsolePool* pool, RomCache* roms, const JobLimits* defaultLimits)
+{
+    SocketReader reader(fd);
+    MemoryConsoleSink sink;
+    std::string line;
+    std::vector<unsigned char> input;
+    while (reader.readLine(line)) {
+        char romFile[4096];
+        unsigned long long maxClocks;
+        unsigned int inputSize;
+        if (3 != sscanf(line.c_str(), "%4095s %llu %u", romFile, &maxClocks, &inputSize)) {
+            writeResponse(fd, "error", 0, 0, "Invalid request", 15);
+            break;
+        }
+        if (!reader.readBytes(input, inputSize)) break;
+        auto rom = roms->get(romFile);
+        if (!rom) {
+            std::string message = "ROM file not found (" + std::string(romFile) + ")";
+            if (!writeResponse(fd, "error", 0, 0, message.c_str(), message.size())) break;
+            continue;
+        }
+        auto console = pool->acquire(rom);
+        JobLimits limits = *defaultLimits;
+        if (maxClocks) limits.maxClocks = maxClocks;
+        bool isLimit = executeJob(console, &sink, input.data(), (int)input.size(), limits);
+        const char* status = console->isEnded() ? "ended" : (isLimit ? "limit" : "invalid");
+        int returnCode = console->getReturnCode();
+        unsigned long long clocks = console->cpu->getClockCount();
+        pool->release(console, rom);
+        if (!writeResponse(fd, status, returnCode, clocks, sink.getData(), sink.getSize())) break;
+    }
+}
+
+// Accept the connections of the socket and process the requests with the pool of the consoles configured by the command line
+static int runServer(Options& options, int argc, char* argv[], std::map<std::string, void*>& dlHandles)
+{
+    if (options.isTrace) {
+        fprintf(stderr, "error: -v is not supported in the server mode\n");
+        return -1;
+    }
+    int consoles = options.threads ? options.threads : (int)std::thread::hardware_concurrency();
+    if (consoles < 1) consoles = 1;
+    ConsolePool pool;
+    RomCache roms;
+    for (int i = 0; i < consoles; i++) {
+        auto console = new Z80Console();
+        pool.add(console);
+        Options consoleOptions;
+        PluginLoader loader;
+        loader.dlHandles = &dlHandles;
+        loader.isQuiet = true;
+        if (!parseArguments(*console, consoleOptions, loader, argc, argv)) {
+            pool.deleteAll();
+            return -1;
+        }
+        console->setConsoleInputMode(false, false); // the input is the data of the request (no prompt in the output)
+        if (console->getRomCount()) {
+            fprintf(stderr, "error: ROM files must be specified in the requests\n");
+            pool.deleteAll();
+            return -1;
+        }
+    }
+
+    int serverFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (sizeof(addr.sun_path) <= strlen(options.serveSocket)) {
+        fprintf(stderr, "error: Socket path is too long (%s)\n", options.serveSocket);
+        pool.deleteAll();
+        return -1;
+    }
+    strcpy(addr.sun_path, options.serveSocket);
+    unlink(options.serveSocket);
+    if (serverFd < 0 || bind(serverFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(serverFd, 64) < 0) {
+        perror("error: Cannot listen the socket");
+        if (0 <= serverFd) close(serverFd);
+        pool.deleteAll();
+        return -1;
+    }
+
+    // stop accepting by SIGINT/SIGTERM (the handler wakes up poll by the pipe), and ignore SIGPIPE of the closed connections
+    if (pipe(serverStopPipe) < 0) {
+        perror("error: Cannot create the pipe");
+        close(serverFd);
+        pool.deleteAll();
+        return -1;
+    }
+    fcntl(serverStopPipe[1], F_SETFL, O_NONBLOCK);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = requestServerStop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "Listening %s with %d consoles\n", options.serveSocket, consoles);
+    JobLimits limits = {options.maxCycles, options.maxInstructions, options.timeoutMs};
+    ServerConnections connections;
+    struct pollfd fds[2];
+    fds[0].fd = serverFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = serverStopPipe[0];
+    fds[1].events = POLLIN;
+    while (!serverStopRequested) {
+        connections.joinClosed();
+        if (poll(fds, 2, -1) < 0) {
+            if (EINTR == errno) continue;
+            perror("error: Cannot wait for the connections");
+            break;
+        }
+        if (fds[1].revents) break;
+        if (!(fds[0].revents & POLLIN)) continue;
+        int fd = accept(serverFd, NULL, NULL);
+        if (fd < 0) continue;
+        connections.start(fd, [&pool, &roms, &limits](int fd) { serveConnection(fd, &pool, &roms, &limits); });
+    }
+    close(serverFd);
+    unlink(options.serveSocket);
+    fprintf(stderr, "Stopping the server\n");
+    connections.shutdownAll(); // the running requests are stopped by the flag
+    pool.deleteAll();
+    close(serverStopPipe[0]);
+    close(serverStopPipe[1]);
+    serverStopPipe[0] = -1;
+    serverStopPipe[1] = -1;
+    return 0;
+}
+
+#define FORK_SERVER_CONTROL_FD 198 // the requests from the client (same as AFL)
+#define FORK_SERVER_STATUS_FD 199  // the responses to the client
+
+/**
+ * Fork the process for each request of the client (the child continues from the state at the checkpoint with copy-on-write memory)
+ *   start:    the server writes 4 bytes (hello) to the status pipe
+ *   request:  the client writes 4 bytes to the control pipe
+ *   response: the server writes the pid of the child (4 bytes), and the wait status of the child (4 bytes) after it exits
+ * Returns 0 in the child, 1 when the client closes the control pipe, and -1 on error.
+ */
+static int runForkServer()
+{
+    int hello = 0;
+    if (4 != write(FORK_SERVER_STATUS_FD, &hello, 4)) {
+        fprintf(stderr, "error: The status pipe (fd %d) is not available\n", FORK_SERVER_STATUS_FD);
+        return -1;
+    }
+    while (true) {
+        int request;
+        ssize_t size = read(FORK_SERVER_CONTROL_FD, &request, 4);
+        if (size < 0 && EINTR == errno) continue;
+        if (4 != size) return 1;
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("error: Cannot fork the process");
+            return -1;
+        }
+        if (0 == pid) {
+            close(FORK_SERVER_CONTROL_FD);
+            close(FORK_SERVER_STATUS_FD);
+            return 0;
         }
+        int status;
+        if (4 != write(FORK_SERVER_STATUS_FD, &pid, 4)) return -1;
+        if (waitpid(pid, &status, 0) < 0) return -1;
+        if (4 != write(FORK_SERVER_STATUS_FD, &status, 4)) return -1;
     }
+}
+
+#define EXIT_LIMIT 124 // the exit code when the execution is stopped by a limit (same as timeout(1))
+
+// Print the registers and the statistics when the execution is stopped by a limit
+static void printStopDump(Z80Console& console, const char* reason, unsigned long long elapsedNs)
+{
+    auto& reg = console.cpu->reg;
+    fprintf(stderr, "ConsoleComputer has been stopped by the %s\n", reason);
+    fprintf(stderr, "  PC=%04X SP=%04X AF=%02X%02X BC=%02X%02X DE=%02X%02X HL=%02X%02X IX=%04X IY=%04X I=%02X R=%02X IFF=%02X\n",
+            reg.PC, reg.SP, reg.pair.A, reg.pair.F, reg.pair.B, reg.pair.C, reg.pair.D, reg.pair.E, reg.pair.H, reg.pair.L,
+            reg.IX, reg.IY, reg.I, reg.R, reg.IFF);
+    fprintf(stderr, "  AF'=%02X%02X BC'=%02X%02X DE'=%02X%02X HL'=%02X%02X\n",
+            reg.back.A, reg.back.F, reg.back.B, reg.back.C, reg.back.D, reg.back.E, reg.back.H, reg.back.L);
+    fprintf(stderr, "  clocks: %llu, instructions: %llu, elapsed: %.3f ms\n",
+            console.cpu->getClockCount(), console.cpu->getInstructionCount(), elapsedNs / 1000000.0);
+}
+
+static unsigned long long processCpuNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Print the non-zero counters as an object keyed by the port or the page number
+static void printStatsCounters(FILE* fp, const char* name, const unsigned long long* counters)
+{
+    fprintf(fp, ", \"%s\": {", name);
+    const char* separator = "";
+    for (int i = 0; i < 256; i++) {
+        if (!counters[i]) continue;
+        fprintf(fp, "%s\"%02X\": %llu", separator, i, counters[i]);
+        separator = ", ";
+    }
+    fprintf(fp, "}");
+}
+
+// Write the statistics of the run as a JSON line (the cycles and the counters are since the reset)
+static bool writeStats(Z80Console& console, const char* fileName, unsigned long long wallNs, unsigned long long cpuNs, unsigned long long runCycles, int returnCode)
+{
+    FILE* fp = 0 == strcmp(fileName, "-") ? stdout : fopen(fileName, "w");
+    if (!fp) {
+        fprintf(stderr, "error: Cannot write the statistics (%s)\n", fileName);
+        return false;
+    }
+    auto& stats = console.getStatistics();
+    fprintf(fp, "{\"cycles\": %llu, \"instructions\": %llu", console.cpu->getClockCount(), console.cpu->getInstructionCount());
+    fprintf(fp, ", \"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"mhz\": %.3f", wallNs / 1000000.0, cpuNs / 1000000.0, wallNs ? runCycles * 1000.0 / wallNs : 0.0);
+    printStatsCounters(fp, "port_reads", stats.portReads);
+    printStatsCounters(fp, "port_writes", stats.portWrites);
+    printStatsCounters(fp, "mmio_calls", stats.mmioCalls);
+    fprintf(fp, ", \"bank_switches\": %llu, \"interrupts\": %llu, \"halt_cycles\": %llu, \"ram_banks_touched\": %d",
+            stats.bankSwitches, console.cpu->getInterruptCount(), console.cpu->getHaltClockCount(), console.getTouchedRamBanks());
+    fprintf(fp, ", \"ended\": %s, \"code\": %d}\n", console.isEnded() ? "true" : "false", returnCode);
+    if (stdout == fp) {
+        fflush(fp);
+    } else {
+        fclose(fp);
+    }
+    return true;
+}
+
+static int run(int argc, char* argv[], std::map<std::string, void*>& dlHandles)
+{
+    FdConsoleSink fdSink(STDOUT_FILENO);
+    FdConsoleSource fdSource(STDIN_FILENO);
+    Z80Console console;
+    ConsoleInputReader inputReader; // stopped before the console is deleted
+    Options options;
+    PluginLoader loader;
+    loader.dlHandles = &dlHandles;
+    loader.isQuiet = false;
+    if (!parseArguments(console, options, loader, argc, argv)) return -1;
+    if (options.batchFile) return runBatch(options, argc, argv, dlHandles);
+    if (options.serveSocket) return runServer(options, argc, argv, dlHandles);
+    ClockPacer pacer;
+    pacer.setClockRate(options.clockRate);
     if (0 == console.getRomCount()) {
         fprintf(stderr, "error: ROM file was not specified\n");
         printUsage();
         return -1;
     }
+    if (options.benchRuns) {
+        int returnCode = runBenchmark(console, options.benchRuns, options.benchMaxClocks, options.isBenchJson);
+        if (options.isProfiling) console.printProfile(stderr);
+        return returnCode;
+    }
+    if (!isatty(STDOUT_FILENO) && !options.isTraceStdout) {
+        // flush the console output by 1MB or 100ms (instead of each line) when it is redirected
+        console.setConsoleOutputBuffer(0x100000, false, 100);
+    }
+    console.setConsoleInputMode(options.isAsyncInput, isatty(STDIN_FILENO));
+    if (!options.isTraceStdout) console.setConsoleSink(&fdSink); // the console output is written in the trace on stdout
+    console.setConsoleSource(&fdSource);
+    bool isForkChild = false;
+    if (options.isForkServer) {
+        if (options.isAsyncInput) {
+            fprintf(stderr, "error: -i async is not supported in the fork server mode\n");
+            return -1;
+        }
+        if (console.hasAsyncOutputDevice()) {
+            fprintf(stderr, "error: -p oa is not supported in the fork server mode\n");
+            return -1;
+        }
+        if (!console.runToCheckpoint(options.checkpointPc, options.checkpointCycle)) {
+            fprintf(stderr, "error: The program has been ended before the checkpoint\n");
+            return -1;
+        }
+        console.flushConsoleOutput(); // not to output the buffered data in each child
+        int result = runForkServer();
+        if (result) return result < 0 ? -1 : 0;
+        isForkChild = true;
+    }
+    if (options.isAsyncInput && !inputReader.start(&console)) {
+        perror("error: Cannot start the input reader");
+        return -1;
+    }
+    if (options.isTrace) console.setTrace(options.isTraceStdout ? stdout : stderr, options.traceFilter, options.isTraceStdout);
+    if (options.isProfiling) {
+        // print the profile of the plugins by kill -USR1 (after the current execution slice)
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = requestProfile;
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &sa, NULL);
+    }
     fprintf(stderr, "Start the ConsoleComputer\n");
-    while (!console.isEnded()) console.execute(DEFAULT_CLOCK_RATE);
-    int returnCode = console.getReturnCode();
-    fprintf(stderr, "ConsoleComputer has been ended (code: %d)\n", returnCode);
+    // execute the quanta (default: 1ms of the emulated clock if paced), and pace after each quantum
+    long clockRate = 0 < pacer.getClockRate() ? pacer.getClockRate() : DEFAULT_CLOCK_RATE;
+    long quantum = options.quantumHz ? clockRate / options.quantumHz : options.quantumClocks;
+    if (!quantum) quantum = 0 < pacer.getClockRate() ? clockRate / 1000 : DEFAULT_CLOCK_RATE;
+    if (quantum < 1 || INT_MAX < quantum) {
+        fprintf(stderr, "error: The quantum must be 1 ~ %d clocks\n", INT_MAX);
+        return -1;
+    }
+    QuantumStats quantumStats;
+    // the limits count from here (the checkpoint in the fork server mode), and are checked per quantum (the cycle and instruction limits are exact)
+    unsigned long long startCycles = console.cpu->getClockCount();
+    unsigned long long startInstructions = console.cpu->getInstructionCount();
+    console.setBudget(options.maxCycles ? startCycles + options.maxCycles : 0, options.maxInstructions ? startInstructions + options.maxInstructions : 0);
+    unsigned long long runStartNs = monotonicNs();
+    unsigned long long runStartCpuNs = processCpuNs();
+    unsigned long long deadlineNs = options.timeoutMs ? runStartNs + options.timeoutMs * 1000000ULL : 0;
+    bool isTimedOut = false;
+    pacer.start(startCycles);
+    while (!console.isEnded() && !console.isBudgetExhausted()) {
+        unsigned long long startNs = monotonicNs();
+        if (console.execute((int)quantum) < 1 && isForkChild && !console.isEnded() && !console.isBudgetExhausted()) abort(); // report the invalid instruction as a crash
+        unsigned long long executedNs = monotonicNs();
+        bool isOverrun = !pacer.wait(console.cpu->getClockCount());
+        unsigned long long pacedNs = monotonicNs();
+        quantumStats.add(executedNs - startNs, pacedNs - executedNs, isOverrun, options.isQuantumStats);
+        if (profileRequested) {
+            profileRequested = 0;
+            console.printProfile(stderr);
+        }
+        if (deadlineNs && deadlineNs <= pacedNs && !console.isEnded()) {
+            isTimedOut = true;
+            break;
+        }
+    }
+    if (options.isTrace) console.setTrace(NULL); // write the rest of the trace before the messages
+    int returnCode;
+    if (console.isEnded()) {
+        returnCode = console.getReturnCode();
+        fprintf(stderr, "ConsoleComputer has been ended (code: %d)\n", returnCode);
+    } else {
+        console.flushConsoleOutput();
+        const char* reason = "timeout";
+        if (!isTimedOut) {
+            bool isCycleLimit = options.maxCycles && startCycles + options.maxCycles <= console.cpu->getClockCount();
+            reason = isCycleLimit ? "cycle limit" : "instruction limit";
+        }
+        printStopDump(console, reason, monotonicNs() - runStartNs);
+        returnCode = EXIT_LIMIT;
+    }
+    if (options.statsFile) {
+        console.flushConsoleOutput(); // keep the order with the console output on stdout
+        unsigned long long wallNs = monotonicNs() - runStartNs;
+        writeStats(console, options.statsFile, wallNs, processCpuNs() - runStartCpuNs, console.cpu->getClockCount() - startCycles, returnCode);
+    }
+    if (0 < pacer.getClockRate()) pacer.printReport(console.cpu->getClockCount());
+    if (options.isQuantumStats) quantumStats.printTotal();
+    if (options.isProfiling) console.printProfile(stderr);
+    return returnCode;
+}
+
+int main(int argc, char* argv[])
+{
+    std::map<std::string, void*> dlHandles;
+    int returnCode = run(argc, argv, dlHandles);
+    // close the libraries after the console has released the devices
     for (auto itr = dlHandles.begin(); dlHandles.end() != itr; itr++) dlclose(itr->second);
     return returnCode;
 }
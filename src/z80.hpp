@@ -69,7 +69,7 @@ class Z80
         unsigned char I;
         unsigned char IFF;
         unsigned char interrupt; // NI-- --mm (N: NMI, I: IRQ, mm: mode)
-        unsigned char consumeClockCounter;
+        int consumeClockCounter;
         unsigned char execEI;
         unsigned char reserved8[2];
     } reg;
@@ -98,6 +98,30 @@ class Z80
         consumeClock(clock);
     }
 
+    inline unsigned short readWord(unsigned short addr, int clockL = 4, int clockH = 4)
+    {
+        if (!CB.read16) {
+            unsigned short l = readByte(addr, clockL);
+            return l | (readByte(addr + 1, clockH) << 8);
+        }
+        if (wtc.read) consumeClock(wtc.read * 2);
+        unsigned short word = CB.read16(CB.arg, addr);
+        consumeClock(clockL + clockH);
+        return word;
+    }
+
+    inline void writeWord(unsigned short addr, unsigned short value, int clockL = 4, int clockH = 4)
+    {
+        if (!CB.write16) {
+            writeByte(addr, value & 0x00FF, clockL);
+            writeByte(addr + 1, (value & 0xFF00) >> 8, clockH);
+            return;
+        }
+        if (wtc.write) consumeClock(wtc.write * 2);
+        CB.write16(CB.arg, addr, value);
+        consumeClock(clockL + clockH);
+    }
+
   private: // Internal functions & variables
     // flag setter
     inline void setFlagS(bool on) { on ? reg.pair.F |= flagS() : reg.pair.F &= ~flagS(); }
@@ -187,7 +211,13 @@ class Z80
         unsigned char (*in)(void* arg, unsigned char port);
         void (*out)(void* arg, unsigned char port, unsigned char value);
         void (*debugMessage)(void* arg, const char* message);
+        void (*trace)(void* arg);
         void (*consumeClock)(void* arg, int clock);
+        unsigned short (*read16)(void* arg, unsigned short addr);
+        void (*write16)(void* arg, unsigned short addr, unsigned short value);
+        int (*copyBlock)(void* arg, unsigned short dst, unsigned short src, int size);
+        int (*inBlock)(void* arg, unsigned char port, unsigned short addr, int size, bool isIncrement);
+        int (*outBlock)(void* arg, unsigned char port, unsigned short addr, int size, bool isIncrement);
         std::vector<BreakPoint*> breakPoints;
         std::vector<BreakOperand*> breakOperands;
         std::vector<ReturnHandler*> returnHandlers;
@@ -196,6 +226,11 @@ class Z80
     } CB;
 
     bool requestBreakFlag;
+    unsigned long long clockCount;
+    unsigned long long instructionCount;
+    unsigned long long interruptCount;
+    int executeClocks; // the clocks remaining in execute at the start of the instruction (limits the iterations of a block callback)
+    unsigned long long haltClockCount;
 
     inline void checkBreakPoint()
     {
@@ -439,6 +474,27 @@ class Z80
         consumeClock(clock);
     }
 
+    // push a word to the stack (written in order of high -> low, which a word access callback should keep when it falls back to the byte access)
+    inline void pushWord(unsigned short value, int clockH = 4, int clockL = 3)
+    {
+        if (!CB.write16) {
+            writeByte(--reg.SP, (value & 0xFF00) >> 8, clockH);
+            writeByte(--reg.SP, value & 0x00FF, clockL);
+            return;
+        }
+        if (wtc.write) consumeClock(wtc.write * 2);
+        reg.SP -= 2;
+        CB.write16(CB.arg, reg.SP, value);
+        consumeClock(clockH + clockL);
+    }
+
+    inline unsigned short popWord(int clockL = 3, int clockH = 3)
+    {
+        unsigned short word = readWord(reg.SP, clockL, clockH);
+        reg.SP += 2;
+        return word;
+    }
+
     static inline int NOP(Z80* ctx)
     {
         if (ctx->isDebug()) ctx->log("[%04X] NOP", ctx->reg.PC);
@@ -667,8 +723,9 @@ class Z80
         unsigned char nL = ctx->readByte(ctx->reg.PC + 1, 3);
         unsigned char nH = ctx->readByte(ctx->reg.PC + 2, 3);
         unsigned short addr = (nH << 8) + nL;
-        unsigned char l = ctx->readByte(addr, 3);
-        unsigned char h = ctx->readByte(addr + 1, 3);
+        unsigned short word = ctx->readWord(addr, 3, 3);
+        unsigned char l = word & 0x00FF;
+        unsigned char h = (word & 0xFF00) >> 8;
         if (ctx->isDebug()) ctx->log("[%04X] LD HL<$%04X>, ($%04X) = $%02X%02X", ctx->reg.PC, ctx->getHL(), addr, h, l);
         ctx->reg.pair.L = l;
         ctx->reg.pair.H = h;
@@ -683,8 +740,7 @@ class Z80
         unsigned char nH = ctx->readByte(ctx->reg.PC + 2, 3);
         unsigned short addr = (nH << 8) + nL;
         if (ctx->isDebug()) ctx->log("[%04X] LD ($%04X), %s", ctx->reg.PC, addr, ctx->registerPairDump(0b10));
-        ctx->writeByte(addr, ctx->reg.pair.L, 3);
-        ctx->writeByte(addr + 1, ctx->reg.pair.H, 3);
+        ctx->writeWord(addr, ctx->getHL(), 3, 3);
         ctx->reg.PC += 3;
         return 0;
     }
@@ -725,12 +781,12 @@ class Z80
 
     static inline int EX_SP_HL(Z80* ctx)
     {
-        unsigned char l = ctx->readByte(ctx->reg.SP);
-        unsigned char h = ctx->readByte(ctx->reg.SP + 1);
+        unsigned short sp = ctx->readWord(ctx->reg.SP);
+        unsigned char l = sp & 0x00FF;
+        unsigned char h = (sp & 0xFF00) >> 8;
         unsigned short hl = ctx->getHL();
         if (ctx->isDebug()) ctx->log("[%04X] EX (SP<$%04X>) = $%02X%02X, HL<$%04X>", ctx->reg.PC, ctx->reg.SP, h, l, hl);
-        ctx->writeByte(ctx->reg.SP, ctx->reg.pair.L);
-        ctx->writeByte(ctx->reg.SP + 1, ctx->reg.pair.H, 3);
+        ctx->writeWord(ctx->reg.SP, hl, 4, 3);
         ctx->reg.pair.L = l;
         ctx->reg.pair.H = h;
         ctx->reg.PC++;
@@ -759,8 +815,7 @@ class Z80
     static inline int PUSH_AF(Z80* ctx)
     {
         if (ctx->isDebug()) ctx->log("[%04X] PUSH AF<$%02X%02X> <SP:$%04X>", ctx->reg.PC, ctx->reg.pair.A, ctx->reg.pair.F, ctx->reg.SP);
-        ctx->writeByte(--ctx->reg.SP, ctx->reg.pair.A);
-        ctx->writeByte(--ctx->reg.SP, ctx->reg.pair.F, 3);
+        ctx->pushWord(ctx->getAF());
         ctx->reg.PC++;
         return 0;
     }
@@ -768,8 +823,9 @@ class Z80
     static inline int POP_AF(Z80* ctx)
     {
         unsigned short sp = ctx->reg.SP;
-        unsigned char l = ctx->readByte(ctx->reg.SP++, 3);
-        unsigned char h = ctx->readByte(ctx->reg.SP++, 3);
+        unsigned short af = ctx->popWord();
+        unsigned char l = af & 0x00FF;
+        unsigned char h = (af & 0xFF00) >> 8;
         if (ctx->isDebug()) ctx->log("[%04X] POP AF <SP:$%04X> = $%02X%02X", ctx->reg.PC, sp, h, l);
         ctx->reg.pair.F = l;
         ctx->reg.pair.A = h;
@@ -793,35 +849,36 @@ class Z80
         return NULL;
     }
 
+    // buffers of the dump functions for the debug messages (per instance to trace the CPUs on the multiple threads)
+    struct DumpBuffer {
+        char reg[8][16];
+        char back[8][16];
+        char pair[4][16];
+        char pairIX[4][16];
+        char pairIY[4][16];
+        char condition[4];
+        char relative[80];
+    } dumpBuffer;
+
     inline char* registerDump(unsigned char r)
     {
-        static char A[16];
-        static char B[16];
-        static char C[16];
-        static char D[16];
-        static char E[16];
-        static char H[16];
-        static char L[16];
-        static char F[16];
-        static char unknown[2];
+        char* buf = dumpBuffer.reg[r & 0b111];
         switch (r & 0b111) {
-            case 0b111: sprintf(A, "A<$%02X>", reg.pair.A); return A;
-            case 0b000: sprintf(B, "B<$%02X>", reg.pair.B); return B;
-            case 0b001: sprintf(C, "C<$%02X>", reg.pair.C); return C;
-            case 0b010: sprintf(D, "D<$%02X>", reg.pair.D); return D;
-            case 0b011: sprintf(E, "E<$%02X>", reg.pair.E); return E;
-            case 0b100: sprintf(H, "H<$%02X>", reg.pair.H); return H;
-            case 0b101: sprintf(L, "L<$%02X>", reg.pair.L); return L;
-            case 0b110: sprintf(F, "F<$%02X>", reg.pair.F); return F;
+            case 0b111: sprintf(buf, "A<$%02X>", reg.pair.A); break;
+            case 0b000: sprintf(buf, "B<$%02X>", reg.pair.B); break;
+            case 0b001: sprintf(buf, "C<$%02X>", reg.pair.C); break;
+            case 0b010: sprintf(buf, "D<$%02X>", reg.pair.D); break;
+            case 0b011: sprintf(buf, "E<$%02X>", reg.pair.E); break;
+            case 0b100: sprintf(buf, "H<$%02X>", reg.pair.H); break;
+            case 0b101: sprintf(buf, "L<$%02X>", reg.pair.L); break;
+            case 0b110: sprintf(buf, "F<$%02X>", reg.pair.F); break;
         }
-        unknown[0] = '?';
-        unknown[1] = '\0';
-        return unknown;
+        return buf;
     }
 
     inline char* conditionDump(unsigned char c)
     {
-        static char CN[4];
+        char* CN = dumpBuffer.condition;
         switch (c) {
             case 0b000: strcpy(CN, "NZ"); break;
             case 0b001: strcpy(CN, "Z"); break;
@@ -838,7 +895,7 @@ class Z80
 
     inline char* relativeDump(signed char e)
     {
-        static char buf[80];
+        char* buf = dumpBuffer.relative;
         if (e < 0) {
             int ee = -e;
             ee -= 2;
@@ -851,72 +908,54 @@ class Z80
 
     inline char* registerDump2(unsigned char r)
     {
-        static char A[16];
-        static char B[16];
-        static char C[16];
-        static char D[16];
-        static char E[16];
-        static char H[16];
-        static char L[16];
-        static char unknown[2] = "?";
+        char* buf = dumpBuffer.back[r & 0b111];
         switch (r) {
-            case 0b111: sprintf(A, "A'<$%02X>", reg.back.A); return A;
-            case 0b000: sprintf(B, "B'<$%02X>", reg.back.B); return B;
-            case 0b001: sprintf(C, "C'<$%02X>", reg.back.C); return C;
-            case 0b010: sprintf(D, "D'<$%02X>", reg.back.D); return D;
-            case 0b011: sprintf(E, "E'<$%02X>", reg.back.E); return E;
-            case 0b100: sprintf(H, "H'<$%02X>", reg.back.H); return H;
-            case 0b101: sprintf(L, "L'<$%02X>", reg.back.L); return L;
-            default: return unknown;
+            case 0b111: sprintf(buf, "A'<$%02X>", reg.back.A); break;
+            case 0b000: sprintf(buf, "B'<$%02X>", reg.back.B); break;
+            case 0b001: sprintf(buf, "C'<$%02X>", reg.back.C); break;
+            case 0b010: sprintf(buf, "D'<$%02X>", reg.back.D); break;
+            case 0b011: sprintf(buf, "E'<$%02X>", reg.back.E); break;
+            case 0b100: sprintf(buf, "H'<$%02X>", reg.back.H); break;
+            case 0b101: sprintf(buf, "L'<$%02X>", reg.back.L); break;
+            default: strcpy(buf, "?");
         }
+        return buf;
     }
 
     inline char* registerPairDump(unsigned char ptn)
     {
-        static char BC[16];
-        static char DE[16];
-        static char HL[16];
-        static char SP[16];
-        static char unknown[2] = "?";
+        char* buf = dumpBuffer.pair[ptn & 0b11];
         switch (ptn & 0b11) {
-            case 0b00: sprintf(BC, "BC<$%02X%02X>", reg.pair.B, reg.pair.C); return BC;
-            case 0b01: sprintf(DE, "DE<$%02X%02X>", reg.pair.D, reg.pair.E); return DE;
-            case 0b10: sprintf(HL, "HL<$%02X%02X>", reg.pair.H, reg.pair.L); return HL;
-            case 0b11: sprintf(SP, "SP<$%04X>", reg.SP); return SP;
-            default: return unknown;
+            case 0b00: sprintf(buf, "BC<$%02X%02X>", reg.pair.B, reg.pair.C); break;
+            case 0b01: sprintf(buf, "DE<$%02X%02X>", reg.pair.D, reg.pair.E); break;
+            case 0b10: sprintf(buf, "HL<$%02X%02X>", reg.pair.H, reg.pair.L); break;
+            case 0b11: sprintf(buf, "SP<$%04X>", reg.SP); break;
         }
+        return buf;
     }
 
     inline char* registerPairDumpIX(unsigned char ptn)
     {
-        static char BC[16];
-        static char DE[16];
-        static char IX[16];
-        static char SP[16];
-        static char unknown[2] = "?";
+        char* buf = dumpBuffer.pairIX[ptn & 0b11];
         switch (ptn & 0b11) {
-            case 0b00: sprintf(BC, "BC<$%02X%02X>", reg.pair.B, reg.pair.C); return BC;
-            case 0b01: sprintf(DE, "DE<$%02X%02X>", reg.pair.D, reg.pair.E); return DE;
-            case 0b10: sprintf(IX, "IX<$%04X>", reg.IX); return IX;
-            case 0b11: sprintf(SP, "SP<$%04X>", reg.SP); return SP;
-            default: return unknown;
+            case 0b00: sprintf(buf, "BC<$%02X%02X>", reg.pair.B, reg.pair.C); break;
+            case 0b01: sprintf(buf, "DE<$%02X%02X>", reg.pair.D, reg.pair.E); break;
+            case 0b10: sprintf(buf, "IX<$%04X>", reg.IX); break;
+            case 0b11: sprintf(buf, "SP<$%04X>", reg.SP); break;
         }
+        return buf;
     }
 
     inline char* registerPairDumpIY(unsigned char ptn)
     {
-        static char BC[16];
-        static char DE[16];
-        static char IY[16];
-        static char SP[16];
-        static char unknown[2] = "?";
+        char* buf = dumpBuffer.pairIY[ptn & 0b11];
         switch (ptn & 0b11) {
-            case 0b00: sprintf(BC, "BC<$%02X%02X>", reg.pair.B, reg.pair.C); return BC;
-            case 0b01: sprintf(DE, "DE<$%02X%02X>", reg.pair.D, reg.pair.E); return DE;
-            case 0b10: sprintf(IY, "IY<$%04X>", reg.IY); return IY;
-            case 0b11: sprintf(SP, "SP<$%04X>", reg.SP); return SP;
-            default: return unknown;
+            case 0b00: sprintf(buf, "BC<$%02X%02X>", reg.pair.B, reg.pair.C); break;
+            case 0b01: sprintf(buf, "DE<$%02X%02X>", reg.pair.D, reg.pair.E); break;
+            case 0b10: sprintf(buf, "IY<$%04X>", reg.IY); break;
+            case 0b11: sprintf(buf, "SP<$%04X>", reg.SP); break;
         }
+        return buf;
     }
 
     // Load Reg. r1 with Reg. r2
@@ -1482,8 +1521,9 @@ class Z80
         unsigned char nL = readByte(reg.PC + 2, 3);
         unsigned char nH = readByte(reg.PC + 3, 3);
         unsigned short addr = (nH << 8) + nL;
-        unsigned char l = readByte(addr, 3);
-        unsigned char h = readByte(addr + 1, 3);
+        unsigned short word = readWord(addr, 3, 3);
+        unsigned char l = word & 0x00FF;
+        unsigned char h = (word & 0xFF00) >> 8;
         reg.WZ = addr + 1;
         if (isDebug()) log("[%04X] LD %s, ($%02X%02X) = $%02X%02X", reg.PC, registerPairDump(rp), nH, nL, h, l);
         switch (rp) {
@@ -1540,8 +1580,7 @@ class Z80
                 if (isDebug()) log("invalid register pair has specified: $%02X", rp);
                 return -1;
         }
-        writeByte(addr, l, 3);
-        writeByte(addr + 1, h, 3);
+        writeWord(addr, (h << 8) | l, 3, 3);
         reg.WZ = addr + 1;
         reg.PC += 4;
         return 0;
@@ -1554,8 +1593,9 @@ class Z80
         unsigned char nL = readByte(reg.PC + 2, 3);
         unsigned char nH = readByte(reg.PC + 3, 3);
         unsigned short addr = (nH << 8) + nL;
-        unsigned char l = readByte(addr, 3);
-        unsigned char h = readByte(addr + 1, 3);
+        unsigned short word = readWord(addr, 3, 3);
+        unsigned char l = word & 0x00FF;
+        unsigned char h = (word & 0xFF00) >> 8;
         if (isDebug()) log("[%04X] LD IX<$%04X>, ($%02X%02X) = $%02X%02X", reg.PC, reg.IX, nH, nL, h, l);
         reg.IX = (h << 8) + l;
         reg.PC += 4;
@@ -1569,8 +1609,9 @@ class Z80
         unsigned char nL = readByte(reg.PC + 2, 3);
         unsigned char nH = readByte(reg.PC + 3, 3);
         unsigned short addr = (nH << 8) + nL;
-        unsigned char l = readByte(addr, 3);
-        unsigned char h = readByte(addr + 1, 3);
+        unsigned short word = readWord(addr, 3, 3);
+        unsigned char l = word & 0x00FF;
+        unsigned char h = (word & 0xFF00) >> 8;
         if (isDebug()) log("[%04X] LD IY<$%04X>, ($%02X%02X) = $%02X%02X", reg.PC, reg.IY, nH, nL, h, l);
         reg.IY = (h << 8) + l;
         reg.PC += 4;
@@ -1584,10 +1625,7 @@ class Z80
         unsigned char nH = readByte(reg.PC + 3, 3);
         unsigned short addr = (nH << 8) + nL;
         if (isDebug()) log("[%04X] LD ($%04X), IX<$%04X>", reg.PC, addr, reg.IX);
-        unsigned char l = reg.IX & 0x00FF;
-        unsigned char h = (reg.IX & 0xFF00) >> 8;
-        writeByte(addr, l, 3);
-        writeByte(addr + 1, h, 3);
+        writeWord(addr, reg.IX, 3, 3);
         reg.PC += 4;
         return 0;
     }
@@ -1599,10 +1637,7 @@ class Z80
         unsigned char nH = readByte(reg.PC + 3, 3);
         unsigned short addr = (nH << 8) + nL;
         if (isDebug()) log("[%04X] LD ($%04X), IY<$%04X>", reg.PC, addr, reg.IY);
-        unsigned char l = reg.IY & 0x00FF;
-        unsigned char h = (reg.IY & 0xFF00) >> 8;
-        writeByte(addr, l, 3);
-        writeByte(addr + 1, h, 3);
+        writeWord(addr, reg.IY, 3, 3);
         reg.PC += 4;
         return 0;
     }
@@ -1642,6 +1677,9 @@ class Z80
         unsigned short bc = getBC();
         unsigned short de = getDE();
         unsigned short hl = getHL();
+        if (isIncDEHL && isRepeat && CB.copyBlock && 1 < bc && !isDebug() && !CB.trace && CB.breakPoints.empty() && CB.breakOperands.empty() && !(reg.interrupt & 0b11000000)) {
+            if (0 <= repeatLDBlock(bc, de, hl)) return 0;
+        }
         unsigned char n = readByte(hl);
         writeByte(de, n);
         if (isIncDEHL) {
@@ -1668,6 +1706,48 @@ class Z80
         }
         return 0;
     }
+
+    // Limit the iterations of a block callback to the clocks remaining in execute, not to overrun the execution slice of the
+    // caller (e.g. the budget or the next event), and the rest is executed by the next iterations
+    inline int limitBlockIterations(int size, int clocksPerIteration)
+    {
+        int limit = (executeClocks - reg.consumeClockCounter) / clocksPerIteration;
+        return limit < size ? limit : size;
+    }
+
+    // Execute the iterations of LDIR within a 256 bytes page by the block copy callback at once
+    inline int repeatLDBlock(unsigned short bc, unsigned short de, unsigned short hl)
+    {
+        int size = bc;
+        if (0x100 - (hl & 0xFF) < size) size = 0x100 - (hl & 0xFF);
+        if (0x100 - (de & 0xFF) < size) size = 0x100 - (de & 0xFF);
+        if (hl < de && de - hl < size) size = de - hl; // must not read the bytes written in this block
+        size = limitBlockIterations(size, wtc.read + wtc.write + 8 + wtc.fretch + wtc.read * 2 + 8 + 5);
+        if (size < 2) return -1;
+        int n = CB.copyBlock(CB.arg, de, hl, size);
+        if (n < 0) return -1;
+        // consume the clocks of the iterations (including fetching the instruction again) as same as the byte copy
+        consumeClock((wtc.read + wtc.write + 8) * size + (wtc.fretch + wtc.read * 2 + 8) * (size - 1));
+        reg.R = ((reg.R + size - 1) & 0x7F) | (reg.R & 0x80);
+        instructionCount += size - 1; // each iteration is counted as an instruction (as same as the byte copy)
+        bc -= size;
+        setBC(bc);
+        setDE(de + size);
+        setHL(hl + size);
+        setFlagH(false);
+        setFlagPV(bc != 0);
+        setFlagN(false);
+        unsigned char an = reg.pair.A + n;
+        setFlagY(an & 0b00000010);
+        setFlagX(an & 0b00001000);
+        if (0 != bc) {
+            consumeClock(5 * size);
+        } else {
+            consumeClock(5 * (size - 1));
+            reg.PC += 2;
+        }
+        return 0;
+    }
     inline int LDI() { return repeatLD(true, false); }
     inline int LDIR() { return repeatLD(true, true); }
     inline int LDD() { return repeatLD(false, false); }
@@ -1677,13 +1757,11 @@ class Z80
     static inline int EX_SP_IX_(Z80* ctx) { return ctx->EX_SP_IX(); }
     inline int EX_SP_IX()
     {
-        unsigned char l = readByte(reg.SP);
-        unsigned char h = readByte(reg.SP + 1);
-        unsigned char i = (reg.IX & 0xFF00) >> 8;
-        unsigned char x = reg.IX & 0x00FF;
+        unsigned short sp = readWord(reg.SP);
+        unsigned char l = sp & 0x00FF;
+        unsigned char h = (sp & 0xFF00) >> 8;
         if (isDebug()) log("[%04X] EX (SP<$%04X>) = $%02X%02X, IX<$%04X>", reg.PC, reg.SP, h, l, reg.IX);
-        writeByte(reg.SP, x);
-        writeByte(reg.SP + 1, i, 3);
+        writeWord(reg.SP, reg.IX, 4, 3);
         reg.IX = (h << 8) + l;
         reg.PC += 2;
         return 0;
@@ -1693,13 +1771,11 @@ class Z80
     static inline int EX_SP_IY_(Z80* ctx) { return ctx->EX_SP_IY(); }
     inline int EX_SP_IY()
     {
-        unsigned char l = readByte(reg.SP);
-        unsigned char h = readByte(reg.SP + 1);
-        unsigned char i = (reg.IY & 0xFF00) >> 8;
-        unsigned char y = reg.IY & 0x00FF;
+        unsigned short sp = readWord(reg.SP);
+        unsigned char l = sp & 0x00FF;
+        unsigned char h = (sp & 0xFF00) >> 8;
         if (isDebug()) log("[%04X] EX (SP<$%04X>) = $%02X%02X, IY<$%04X>", reg.PC, reg.SP, h, l, reg.IY);
-        writeByte(reg.SP, y);
-        writeByte(reg.SP + 1, i, 3);
+        writeWord(reg.SP, reg.IY, 4, 3);
         reg.IY = (h << 8) + l;
         reg.PC += 2;
         return 0;
@@ -1731,8 +1807,7 @@ class Z80
                 if (isDebug()) log("invalid register pair has specified: $%02X", rp);
                 return -1;
         }
-        writeByte(--reg.SP, h);
-        writeByte(--reg.SP, l, 3);
+        pushWord((h << 8) | l);
         reg.PC++;
         return 0;
     }
@@ -1763,8 +1838,9 @@ class Z80
                 if (isDebug()) log("invalid register pair has specified: $%02X", rp);
                 return -1;
         }
-        unsigned char lm = readByte(reg.SP++, 3);
-        unsigned char hm = readByte(reg.SP++, 3);
+        unsigned short word = popWord();
+        unsigned char lm = word & 0x00FF;
+        unsigned char hm = (word & 0xFF00) >> 8;
         if (isDebug()) log("[%04X] POP %s <SP:$%04X> = $%02X%02X", reg.PC, registerPairDump(rp), sp, hm, lm);
         *l = lm;
         *h = hm;
@@ -1777,10 +1853,7 @@ class Z80
     inline int PUSH_IX()
     {
         if (isDebug()) log("[%04X] PUSH IX<$%04X> <SP:$%04X>", reg.PC, reg.IX, reg.SP);
-        unsigned char h = (reg.IX & 0xFF00) >> 8;
-        unsigned char l = reg.IX & 0x00FF;
-        writeByte(--reg.SP, h);
-        writeByte(--reg.SP, l, 3);
+        pushWord(reg.IX);
         reg.PC += 2;
         return 0;
     }
@@ -1790,8 +1863,9 @@ class Z80
     inline int POP_IX()
     {
         unsigned short sp = reg.SP;
-        unsigned char l = readByte(reg.SP++, 3);
-        unsigned char h = readByte(reg.SP++, 3);
+        unsigned short word = popWord();
+        unsigned char l = word & 0x00FF;
+        unsigned char h = (word & 0xFF00) >> 8;
         if (isDebug()) log("[%04X] POP IX <SP:$%04X> = $%02X%02X", reg.PC, sp, h, l);
         reg.IX = (h << 8) + l;
         reg.PC += 2;
@@ -1803,10 +1877,7 @@ class Z80
     inline int PUSH_IY()
     {
         if (isDebug()) log("[%04X] PUSH IY<$%04X> <SP:$%04X>", reg.PC, reg.IY, reg.SP);
-        unsigned char h = (reg.IY & 0xFF00) >> 8;
-        unsigned char l = reg.IY & 0x00FF;
-        writeByte(--reg.SP, h);
-        writeByte(--reg.SP, l, 3);
+        pushWord(reg.IY);
         reg.PC += 2;
         return 0;
     }
@@ -1816,8 +1887,9 @@ class Z80
     inline int POP_IY()
     {
         unsigned short sp = reg.SP;
-        unsigned char l = readByte(reg.SP++, 3);
-        unsigned char h = readByte(reg.SP++, 3);
+        unsigned short word = popWord();
+        unsigned char l = word & 0x00FF;
+        unsigned char h = (word & 0xFF00) >> 8;
         if (isDebug()) log("[%04X] POP IY <SP:$%04X> = $%02X%02X", reg.PC, sp, h, l);
         reg.IY = (h << 8) + l;
         reg.PC += 2;
@@ -5108,11 +5180,7 @@ class Z80
         unsigned short addr = (nH << 8) + nL;
         if (ctx->isDebug()) ctx->log("[%04X] CALL $%04X (%s)", ctx->reg.PC, addr, ctx->registerPairDump(0b11));
         ctx->reg.PC += 3;
-        unsigned char pcL = ctx->reg.PC & 0x00FF;
-        unsigned char pcH = (ctx->reg.PC & 0xFF00) >> 8;
-        ctx->writeByte(ctx->reg.SP - 1, pcH, 3);
-        ctx->writeByte(ctx->reg.SP - 2, pcL, 3);
-        ctx->reg.SP -= 2;
+        ctx->pushWord(ctx->reg.PC, 3, 3);
         ctx->reg.WZ = addr;
         ctx->reg.PC = addr;
         ctx->invokeCallHandlers();
@@ -5123,9 +5191,7 @@ class Z80
     static inline int RET(Z80* ctx)
     {
         ctx->invokeReturnHandlers();
-        unsigned char nL = ctx->readByte(ctx->reg.SP, 3);
-        unsigned char nH = ctx->readByte(ctx->reg.SP + 1, 3);
-        unsigned short addr = (nH << 8) + nL;
+        unsigned short addr = ctx->readWord(ctx->reg.SP, 3, 3);
         if (ctx->isDebug()) ctx->log("[%04X] RET to $%04X (%s)", ctx->reg.PC, addr, ctx->registerPairDump(0b11));
         ctx->reg.SP += 2;
         ctx->reg.PC = addr;
@@ -5162,11 +5228,7 @@ class Z80
         if (isDebug()) log("[%04X] CALL %s, $%04X (%s) <execute:%s>", reg.PC, conditionDump(c), addr, registerPairDump(0b11), execute ? "YES" : "NO");
         reg.PC += 3;
         if (execute) {
-            unsigned char pcL = reg.PC & 0x00FF;
-            unsigned char pcH = (reg.PC & 0xFF00) >> 8;
-            writeByte(reg.SP - 1, pcH);
-            writeByte(reg.SP - 2, pcL, 3);
-            reg.SP -= 2;
+            pushWord(reg.PC);
             reg.PC = addr;
             invokeCallHandlers();
         }
@@ -5203,9 +5265,7 @@ class Z80
             return consumeClock(1);
         }
         invokeReturnHandlers();
-        unsigned char nL = readByte(reg.SP);
-        unsigned char nH = readByte(reg.SP + 1, 3);
-        unsigned short addr = (nH << 8) + nL;
+        unsigned short addr = readWord(reg.SP, 4, 3);
         if (isDebug()) log("[%04X] RET %s to $%04X (%s) <execute:YES>", reg.PC, conditionDump(c), addr, registerPairDump(0b11));
         reg.SP += 2;
         reg.PC = addr;
@@ -5217,9 +5277,7 @@ class Z80
     inline int RETI()
     {
         invokeReturnHandlers();
-        unsigned char nL = readByte(reg.SP, 3);
-        unsigned char nH = readByte(reg.SP + 1, 3);
-        unsigned short addr = (nH << 8) + nL;
+        unsigned short addr = readWord(reg.SP, 3, 3);
         if (isDebug()) log("[%04X] RETI to $%04X (%s)", reg.PC, addr, registerPairDump(0b11));
         reg.SP += 2;
         reg.PC = addr;
@@ -5232,9 +5290,7 @@ class Z80
     inline int RETN()
     {
         invokeReturnHandlers();
-        unsigned char nL = readByte(reg.SP, 3);
-        unsigned char nH = readByte(reg.SP + 1, 3);
-        unsigned short addr = (nH << 8) + nL;
+        unsigned short addr = readWord(reg.SP, 3, 3);
         if (isDebug()) log("[%04X] RETN to $%04X (%s)", reg.PC, addr, registerPairDump(0b11));
         reg.SP += 2;
         reg.PC = addr;
@@ -5266,11 +5322,7 @@ class Z80
         unsigned short addr = t * 8;
         if (isDebug()) log("[%04X] RST $%04X (%s)", reg.PC, addr, registerPairDump(0b11));
         if (incrementPC) reg.PC++;
-        unsigned char pcH = (reg.PC & 0xFF00) >> 8;
-        unsigned char pcL = reg.PC & 0x00FF;
-        writeByte(reg.SP - 1, pcH);
-        writeByte(reg.SP - 2, pcL, 3);
-        reg.SP -= 2;
+        pushWord(reg.PC);
         reg.WZ = addr;
         reg.PC = addr;
         invokeCallHandlers();
@@ -5318,9 +5370,23 @@ class Z80
         setFlagPV(reg.pair.B == 0x7F);
     }
 
+    // Set the undocumented flags of INI/IND/INIR/INDR by the input byte (after decrementB_forRepeatIO)
+    // k = value + ((C + 1) & 0xFF): N = bit 7 of value, H = C = (k > 0xFF), PV = parity((k & 7) ^ B)
+    inline void setFlagsForRepeatIN(unsigned char i)
+    {
+        int k = i + ((reg.pair.C + 1) & 0xFF);
+        setFlagN(i & 0x80);                                   // NOTE: undocumented
+        setFlagC(0xFF < k);                                   // NOTE: undocumented
+        setFlagH(isFlagC());                                  // NOTE: undocumented
+        setFlagPV(isEvenNumberBits((k & 0x07) ^ reg.pair.B)); // NOTE: undocumented
+    }
+
     // Load location (HL) with input from port (C); or increment/decrement HL and decrement B
     inline int repeatIN(bool isIncHL, bool isRepeat)
     {
+        if (isRepeat && CB.inBlock && 1 != reg.pair.B && !isDebug() && !CB.trace && CB.breakPoints.empty() && CB.breakOperands.empty() && !(reg.interrupt & 0b11000000)) {
+            if (0 <= repeatINBlock(isIncHL)) return 0;
+        }
         reg.WZ = getBC() + (isIncHL ? 1 : -1);
         unsigned char i = inPort(reg.pair.C);
         unsigned short hl = getHL();
@@ -5336,10 +5402,7 @@ class Z80
         hl += isIncHL ? 1 : -1;
         setHL(hl);
         setFlagZ(reg.pair.B == 0);
-        setFlagN(i & 0x80);                                             // NOTE: undocumented
-        setFlagC(0xFF < i + ((reg.pair.C + 1) & 0xFF));                 // NOTE: undocumented
-        setFlagH(isFlagC());                                            // NOTE: undocumented
-        setFlagPV(i + (((reg.pair.C + 1) & 0xFF) & 0x07) ^ reg.pair.B); // NOTE: undocumented
+        setFlagsForRepeatIN(i);
         if (isRepeat && 0 != reg.pair.B) {
             consumeClock(5);
         } else {
@@ -5347,6 +5410,33 @@ class Z80
         }
         return 0;
     }
+
+    // Execute the iterations of INIR/INDR by the block input callback at once
+    inline int repeatINBlock(bool isIncHL)
+    {
+        int b = reg.pair.B ? reg.pair.B : 256;
+        int size = limitBlockIterations(b, wtc.write + 8 + wtc.fretch + wtc.read * 2 + 8 + 5);
+        if (size < 2) return -1;
+        unsigned short hl = getHL();
+        int i = CB.inBlock(CB.arg, reg.pair.C, hl, size, isIncHL);
+        if (i < 0) return -1;
+        // consume the clocks of the iterations (including fetching the instruction again) as same as the byte input
+        consumeClock((wtc.write + 8) * size + (wtc.fretch + wtc.read * 2 + 8 + 5) * (size - 1));
+        reg.R = ((reg.R + size - 1) & 0x7F) | (reg.R & 0x80);
+        instructionCount += size - 1; // each iteration is counted as an instruction (as same as the byte input)
+        reg.pair.B = (b - size + 1) & 0xFF; // the last iteration
+        reg.WZ = getBC() + (isIncHL ? 1 : -1);
+        decrementB_forRepeatIO();
+        setHL(hl + (isIncHL ? size : -size));
+        setFlagZ(reg.pair.B == 0);
+        setFlagsForRepeatIN(i);
+        if (0 != reg.pair.B) {
+            consumeClock(5);
+        } else {
+            reg.PC += 2;
+        }
+        return 0;
+    }
     inline int INI() { return repeatIN(true, false); }
     inline int INIR() { return repeatIN(true, true); }
     inline int IND() { return repeatIN(false, false); }
@@ -5375,6 +5465,9 @@ class Z80
     // Load Output port (C) with location (HL), increment/decrement HL and decrement B
     inline int repeatOUT(bool isIncHL, bool isRepeat)
     {
+        if (isRepeat && CB.outBlock && 1 != reg.pair.B && !isDebug() && !CB.trace && CB.breakPoints.empty() && CB.breakOperands.empty() && !(reg.interrupt & 0b11000000)) {
+            if (0 <= repeatOUTBlock(isIncHL)) return 0;
+        }
         unsigned short hl = getHL();
         unsigned char o = readByte(hl);
         if (isDebug()) {
@@ -5401,6 +5494,37 @@ class Z80
         }
         return 0;
     }
+
+    // Execute the iterations of OUTIR/OUTDR by the block output callback at once
+    inline int repeatOUTBlock(bool isIncHL)
+    {
+        int b = reg.pair.B ? reg.pair.B : 256;
+        int size = limitBlockIterations(b, wtc.read + 8 + wtc.fretch + wtc.read * 2 + 8 + 5);
+        if (size < 2) return -1;
+        unsigned short hl = getHL();
+        int o = CB.outBlock(CB.arg, reg.pair.C, hl, size, isIncHL);
+        if (o < 0) return -1;
+        // consume the clocks of the iterations (including fetching the instruction again) as same as the byte output
+        consumeClock((wtc.read + 8) * size + (wtc.fretch + wtc.read * 2 + 8 + 5) * (size - 1));
+        reg.R = ((reg.R + size - 1) & 0x7F) | (reg.R & 0x80);
+        instructionCount += size - 1; // each iteration is counted as an instruction (as same as the byte output)
+        reg.pair.B = (b - size + 1) & 0xFF; // the last iteration
+        decrementB_forRepeatIO();
+        reg.WZ = getBC() + (isIncHL ? 1 : -1);
+        hl += isIncHL ? size : -size;
+        setHL(hl);
+        setFlagZ(reg.pair.B == 0);
+        setFlagN(o & 0x80);                                // NOTE: ACTUAL FLAG CONDITION IS UNKNOWN
+        setFlagH(reg.pair.L + o > 0xFF);                   // NOTE: ACTUAL FLAG CONDITION IS UNKNOWN
+        setFlagC(isFlagH());                               // NOTE: ACTUAL FLAG CONDITION IS UNKNOWN
+        setFlagPV(((reg.pair.H + o) & 0x07) ^ reg.pair.B); // NOTE: ACTUAL FLAG CONDITION IS UNKNOWN
+        if (0 != reg.pair.B) {
+            consumeClock(5);
+        } else {
+            reg.PC += 2;
+        }
+        return 0;
+    }
     inline int OUTI() { return repeatOUT(true, false); }
     inline int OUTIR() { return repeatOUT(true, true); }
     inline int OUTD() { return repeatOUT(false, false); }
@@ -5675,15 +5799,12 @@ class Z80
             }
             reg.interrupt &= 0b01111111;
             reg.IFF &= ~IFF_HALT();
+            interruptCount++;
             if (isDebug()) log("EXECUTE NMI: $%04X", reg.interruptAddrN);
             reg.R = ((reg.R + 1) & 0x7F) | (reg.R & 0x80);
             reg.IFF |= IFF_NMI();
             reg.IFF &= ~IFF1();
-            unsigned char pcL = reg.PC & 0x00FF;
-            unsigned char pcH = (reg.PC & 0xFF00) >> 8;
-            writeByte(reg.SP - 1, pcH);
-            writeByte(reg.SP - 2, pcL);
-            reg.SP -= 2;
+            pushWord(reg.PC, 4, 4);
             reg.PC = reg.interruptAddrN;
             consumeClock(11);
             invokeCallHandlers();
@@ -5694,6 +5815,7 @@ class Z80
             }
             reg.interrupt &= 0b10111111;
             reg.IFF &= ~IFF_HALT();
+            interruptCount++;
             reg.IFF |= IFF_IRQ();
             reg.IFF &= ~(IFF1() | IFF2());
             reg.R = ((reg.R + 1) & 0x7F) | (reg.R & 0x80);
@@ -5711,16 +5833,11 @@ class Z80
                     RST(7, false);
                     break;
                 case 2: { // mode 2
-                    unsigned char pcL = reg.PC & 0x00FF;
-                    unsigned char pcH = (reg.PC & 0xFF00) >> 8;
-                    writeByte(reg.SP - 1, pcH);
-                    writeByte(reg.SP - 2, pcL);
-                    reg.SP -= 2;
+                    pushWord(reg.PC, 4, 4);
                     unsigned short addr = reg.I;
                     addr <<= 8;
                     addr |= reg.interruptVector;
-                    unsigned short pc = readByte(addr);
-                    pc += ((unsigned short)readByte(addr + 1)) << 8;
+                    unsigned short pc = readWord(addr);
                     if (isDebug()) log("EXECUTE INT MODE2: ($%04X) = $%04X", addr, pc);
                     reg.PC = pc;
                     consumeClock(3);
@@ -5751,6 +5868,11 @@ class Z80
         this->CB.out = out;
         this->CB.arg = arg;
         ::memset(&reg, 0, sizeof(reg));
+        clockCount = 0;
+        instructionCount = 0;
+        interruptCount = 0;
+        haltClockCount = 0;
+        executeClocks = 0;
         reg.pair.A = 0xff;
         reg.pair.F = 0xff;
         reg.SP = 0xffff;
@@ -5770,6 +5892,12 @@ class Z80
         CB.debugMessage = debugMessage;
     }
 
+    // called before each instruction is executed (not in the halt state) with the registers before the instruction
+    void setTraceHandler(void (*trace)(void*) = NULL)
+    {
+        CB.trace = trace;
+    }
+
     inline bool isDebug()
     {
         return CB.debugMessage != NULL;
@@ -5876,6 +6004,48 @@ class Z80
         CB.consumeClock = consumeClock;
     }
 
+    void setWordAccessCallback(unsigned short (*read16)(void*, unsigned short) = NULL, void (*write16)(void*, unsigned short, unsigned short) = NULL)
+    {
+        CB.read16 = read16;
+        CB.write16 = write16;
+    }
+
+    // copyBlock returns the last byte copied, or -1 if the copy is not handled (LDIR executes byte by byte)
+    void setBlockCopyCallback(int (*copyBlock)(void*, unsigned short, unsigned short, int) = NULL)
+    {
+        CB.copyBlock = copyBlock;
+    }
+
+    // inBlock/outBlock transfer size bytes between the port and the memory from addr (decrement if not isIncrement),
+    // and return the last byte transferred, or -1 if the transfer is not handled (INIR/OTIR execute byte by byte)
+    void setBlockIOCallback(int (*inBlock)(void*, unsigned char, unsigned short, int, bool) = NULL, int (*outBlock)(void*, unsigned char, unsigned short, int, bool) = NULL)
+    {
+        CB.inBlock = inBlock;
+        CB.outBlock = outBlock;
+    }
+
+    // total clocks executed (including the instruction in execution when called from a callback)
+    unsigned long long getClockCount() { return clockCount + reg.consumeClockCounter; }
+    // total instructions executed (each iteration of a block instruction such as LDIR is counted, and the halt state is not counted)
+    unsigned long long getInstructionCount() { return instructionCount; }
+    // total interrupts (IRQ and NMI) accepted
+    unsigned long long getInterruptCount() { return interruptCount; }
+    // total clocks spent in the halt state
+    unsigned long long getHaltClockCount() { return haltClockCount; }
+    void resetClockCount()
+    {
+        clockCount = 0;
+        instructionCount = 0;
+        interruptCount = 0;
+        haltClockCount = 0;
+    }
+
+    // consume the clocks of an external operation (e.g. DMA of a device) in the current instruction
+    void consumeExternalClock(int clocks)
+    {
+        consumeClock(clocks);
+    }
+
     void requestBreak()
     {
         requestBreakFlag = true;
@@ -5902,16 +6072,20 @@ class Z80
     {
         int executed = 0;
         requestBreakFlag = false;
+        clockCount += reg.consumeClockCounter; // an interrupt accepted after the last instruction of the previous execute
         reg.consumeClockCounter = 0;
         while (0 < clock && !requestBreakFlag) {
             // execute NOP while halt
             if (reg.IFF & IFF_HALT()) {
                 reg.execEI = 0;
                 readByte(reg.PC); // NOTE: read and discard (to be consumed 4Hz)
+                haltClockCount += reg.consumeClockCounter;
             } else {
                 if (wtc.fretch) consumeClock(wtc.fretch);
                 checkBreakPoint();
+                if (CB.trace) CB.trace(CB.arg);
                 reg.execEI = 0;
+                executeClocks = clock;
                 int operandNumber = readByte(reg.PC, 2);
                 updateRefreshRegister();
                 checkBreakOperand(operandNumber);
@@ -5919,9 +6093,11 @@ class Z80
                     if (isDebug()) log("[%04X] detected an invalid operand: $%02X", reg.PC, operandNumber);
                     return 0;
                 }
+                instructionCount++;
             }
             executed += reg.consumeClockCounter;
             clock -= reg.consumeClockCounter;
+            clockCount += reg.consumeClockCounter;
             reg.consumeClockCounter = 0;
             checkInterrupt();
         }
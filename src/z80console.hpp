@@ -25,10 +25,16 @@
  * -----------------------------------------------------------------------------
  */
 #include "z80.hpp"
+#include "z80console_device.h"
+#include "z80console_io.hpp"
+#include "z80console_trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <new>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <thread>
 #include <vector>
 
 class Z80Console
@@ -48,10 +54,323 @@ class Z80Console
         unsigned char (*in[256])(void*, unsigned char);
         void (*write[256])(void*, unsigned short, unsigned char);
         unsigned char (*read[256])(void*, unsigned short);
+        void (*write16[256])(void*, unsigned short, unsigned short);
+        unsigned short (*read16[256])(void*, unsigned short);
+        void (*writeBlock[256])(void*, unsigned short, const unsigned char*, unsigned short);
+        void (*readBlock[256])(void*, unsigned short, unsigned char*, unsigned short);
+        struct MemoryRegion {
+            unsigned char* ptr;
+            unsigned char flags;
+            bool dirty;
+            void (*notify)(void*, unsigned char);
+        } region[256];
         std::vector<Handler*> startHandlers;
         std::vector<Handler*> endHandlers;
+        Z80ConsoleDevice* port[256];             // descriptor-based devices (plugin ABI v2)
+        std::vector<Z80ConsoleDevice*> instances; // owned copies of the descriptors
+        struct TimedDevice {
+            void* arg;
+            unsigned long long (*advanceTo)(void*, unsigned long long);
+            unsigned long long deadline; // 0: none
+        };
+        TimedDevice* timed[256];
+        std::vector<TimedDevice*> timedDevices;
     } devices;
 
+    // catch up the device to the current cycle
+    inline void advanceDevice(ExternalDevices::TimedDevice* device)
+    {
+        device->deadline = device->advanceTo(device->arg, cpu->getClockCount());
+        if (device->deadline) breakSliceAt(device->deadline);
+    }
+
+    // events scheduled at the cycle (min-heap ordered by the cycle and the id)
+    struct Event {
+        unsigned long long cycle;
+        int id;
+        void (*callback)(void* arg, unsigned long long cycle);
+        void* arg;
+        bool operator<(const Event& event) const
+        {
+            return cycle != event.cycle ? event.cycle < cycle : event.id < id; // inverted for the min-heap
+        }
+    };
+    std::vector<Event> events;
+    int lastEventId;
+    unsigned long long sliceEnd; // the cycle at the end of the executing slice (0: not executing)
+    bool isSliceBroken;
+
+    // stop the executing slice at the instruction boundary if the cycle is in the slice
+    inline void breakSliceAt(unsigned long long cycle)
+    {
+        if (sliceEnd && cycle < sliceEnd) {
+            isSliceBroken = true;
+            cpu->requestBreak();
+        }
+    }
+
+    // fire the events reached the cycle, and returns the clocks until the next event (INT_MAX: none)
+    int fireEvents()
+    {
+        unsigned long long now = cpu->getClockCount();
+        while (!events.empty() && events.front().cycle <= now) {
+            std::pop_heap(events.begin(), events.end());
+            Event event = events.back();
+            events.pop_back();
+            event.callback(event.arg, event.cycle);
+            if (ctx.endFlag) return INT_MAX;
+        }
+        if (events.empty()) return INT_MAX;
+        return events.front().cycle - now < INT_MAX ? (int)(events.front().cycle - now) : INT_MAX;
+    }
+
+    // advance the devices reached the deadline, and returns the clocks until the next deadline (INT_MAX: none)
+    int advanceDevices()
+    {
+        unsigned long long now = cpu->getClockCount();
+        unsigned long long next = 0;
+        for (auto device : devices.timedDevices) {
+            if (device->deadline && device->deadline <= now) advanceDevice(device);
+            if (device->deadline && (!next || device->deadline < next)) next = device->deadline;
+        }
+        if (!next) return INT_MAX;
+        return next - now < INT_MAX ? (int)(next - now) : INT_MAX;
+    }
+
+    void addTimedDevice(unsigned char portNumber, int portCount, void* arg, unsigned long long (*advanceTo)(void*, unsigned long long))
+    {
+        auto device = new ExternalDevices::TimedDevice();
+        device->arg = arg;
+        device->advanceTo = advanceTo;
+        device->deadline = 0;
+        devices.timedDevices.push_back(device);
+        for (int port = portNumber; port < portNumber + portCount; port++) devices.timed[port] = device;
+    }
+
+    // OUT to the output devices processed on the worker thread (single producer: CPU, single consumer: worker)
+    struct OutputWorker {
+        struct Entry {
+            unsigned long long cycle;
+            unsigned char port;
+            unsigned char value;
+        };
+        bool isAsync[256];
+        bool isDropOnFull;
+        std::vector<Entry> queue;
+        std::atomic<unsigned int> head;
+        std::atomic<unsigned int> tail;
+        std::atomic<bool> running;
+        std::thread thread;
+        unsigned long long cycle; // the cycle of the OUT in process (worker thread)
+        unsigned long long dropped;
+    } outputWorker;
+
+    void startOutputWorker()
+    {
+        if (!hasAsyncOutputDevice() || outputWorker.thread.joinable()) return;
+        outputWorker.head = 0;
+        outputWorker.tail = 0;
+        outputWorker.running = true;
+        outputWorker.thread = std::thread(runOutputWorker, this);
+    }
+
+    // stop the worker thread after processing the queued OUTs
+    void stopOutputWorker()
+    {
+        if (!outputWorker.thread.joinable()) return;
+        outputWorker.running.store(false, std::memory_order_release);
+        outputWorker.thread.join();
+    }
+
+    // wait for the worker thread to process the queued OUTs
+    inline void waitOutputWorker()
+    {
+        while (outputWorker.head.load(std::memory_order_relaxed) != outputWorker.tail.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    }
+
+    inline void pushOutput(unsigned char port, unsigned char value)
+    {
+        unsigned int head = outputWorker.head.load(std::memory_order_relaxed);
+        while (head - outputWorker.tail.load(std::memory_order_acquire) == outputWorker.queue.size()) {
+            if (outputWorker.isDropOnFull) {
+                outputWorker.dropped++;
+                return;
+            }
+            std::this_thread::yield(); // back-pressure
+        }
+        auto entry = &outputWorker.queue[head & (outputWorker.queue.size() - 1)];
+        entry->cycle = cpu->getClockCount();
+        entry->port = port;
+        entry->value = value;
+        outputWorker.head.store(head + 1, std::memory_order_release);
+    }
+
+    static void runOutputWorker(Z80Console* _this)
+    {
+        auto worker = &_this->outputWorker;
+        unsigned int mask = (unsigned int)worker->queue.size() - 1;
+        while (true) {
+            bool running = worker->running.load(std::memory_order_acquire);
+            unsigned int tail = worker->tail.load(std::memory_order_relaxed);
+            unsigned int head = worker->head.load(std::memory_order_acquire);
+            if (tail == head) {
+                if (!running) break;
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+                continue;
+            }
+            for (; tail != head; tail++) {
+                auto entry = &worker->queue[tail & mask];
+                worker->cycle = entry->cycle;
+                _this->devices.out[entry->port](_this->cpu, entry->port, entry->value);
+                worker->tail.store(tail + 1, std::memory_order_release);
+            }
+        }
+    }
+
+    // the executed instructions traced on the worker thread (single producer: CPU, single consumer: worker)
+    struct TraceWorker {
+        FILE* fp;
+        TraceFilter filter;
+        std::vector<TraceRecord> queue;
+        std::atomic<unsigned int> head;
+        std::atomic<unsigned int> tail;
+        std::atomic<bool> running;
+        std::thread thread;
+        ConsoleSink* sink; // the sink replaced by the trace sink (NULL: not replaced)
+    } traceWorker;
+
+    // write the console output into the trace in order (for the trace written to the same stream)
+    class TraceSink : public ConsoleSink
+    {
+      private:
+        Z80Console* console;
+
+      public:
+        TraceSink(Z80Console* console) { this->console = console; }
+        int write(const void* buffer, int size) override
+        {
+            const unsigned char* ptr = (const unsigned char*)buffer;
+            for (int offset = 0; offset < size; offset += TRACE_OUTPUT_SIZE) {
+                auto record = console->reserveTraceRecord();
+                record->type = TRACE_RECORD_OUTPUT;
+                record->size = size - offset < TRACE_OUTPUT_SIZE ? size - offset : TRACE_OUTPUT_SIZE;
+                memcpy(record->data, ptr + offset, record->size);
+                console->commitTraceRecord();
+            }
+            return size;
+        }
+    } traceSink;
+
+    inline TraceRecord* reserveTraceRecord()
+    {
+        unsigned int head = traceWorker.head.load(std::memory_order_relaxed);
+        while (head - traceWorker.tail.load(std::memory_order_acquire) == traceWorker.queue.size()) {
+            std::this_thread::yield(); // back-pressure (the trace is never dropped)
+        }
+        return &traceWorker.queue[head & (traceWorker.queue.size() - 1)];
+    }
+
+    inline void commitTraceRecord()
+    {
+        traceWorker.head.store(traceWorker.head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // read the guest memory for the trace without calling the memory mapped I/O handlers (0xFF)
+    inline unsigned char peekMemory(unsigned short addr)
+    {
+        unsigned char page = (addr & 0xFF00) >> 8;
+        if (devices.region[page].flags & MEMORY_REGION_READ) return devices.region[page].ptr[addr & 0xFF];
+        if (devices.read[page]) return 0xFF;
+        int n = (addr & 0xE000) >> 13;
+        return isRamIndex(n) ? ram.data[n % ram.count][addr & 0x1FFF] : rom.data[n % rom.count][addr & 0x1FFF];
+    }
+
+    // called by the CPU before each instruction while tracing
+    static void traceInstruction(void* ctx)
+    {
+        auto _this = (Z80Console*)ctx;
+        auto filter = &_this->traceWorker.filter;
+        auto reg = &_this->cpu->reg;
+        if (reg->PC < filter->pcStart || filter->pcEnd < reg->PC) return;
+        unsigned char bank = _this->ctx.banks[reg->PC >> 13];
+        if (0 <= filter->bank && bank != filter->bank) return;
+        unsigned long long number = _this->cpu->getInstructionCount() + 1;
+        if (number < filter->from) return;
+        if (filter->to && filter->to < number) {
+            _this->cpu->setTraceHandler(NULL); // no more instructions to trace
+            return;
+        }
+        auto record = _this->reserveTraceRecord();
+        record->type = TRACE_RECORD_INSTRUCTION;
+        record->cycle = _this->cpu->getClockCount();
+        record->pc = reg->PC;
+        record->sp = reg->SP;
+        record->af = (reg->pair.A << 8) | reg->pair.F;
+        record->bc = (reg->pair.B << 8) | reg->pair.C;
+        record->de = (reg->pair.D << 8) | reg->pair.E;
+        record->hl = (reg->pair.H << 8) | reg->pair.L;
+        record->ix = reg->IX;
+        record->iy = reg->IY;
+        record->bank = bank;
+        for (int i = 0; i < 4; i++) record->code[i] = _this->peekMemory(reg->PC + i);
+        _this->commitTraceRecord();
+    }
+
+    // format the records into a large buffer, and write it when it is full or the ring buffer is empty
+    static void runTraceWorker(Z80Console* _this)
+    {
+        auto worker = &_this->traceWorker;
+        unsigned int mask = (unsigned int)worker->queue.size() - 1;
+        std::vector<char> buffer(TRACE_BUFFER_SIZE);
+        size_t length = 0;
+        TraceFormatter formatter;
+        while (true) {
+            bool running = worker->running.load(std::memory_order_acquire);
+            unsigned int tail = worker->tail.load(std::memory_order_relaxed);
+            unsigned int head = worker->head.load(std::memory_order_acquire);
+            if (tail == head) {
+                if (length) {
+                    fwrite(buffer.data(), 1, length, worker->fp);
+                    fflush(worker->fp);
+                    length = 0;
+                }
+                if (!running) break;
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                continue;
+            }
+            for (; tail != head; tail++) {
+                if (buffer.size() - length < TRACE_LINE_MAX) {
+                    fwrite(buffer.data(), 1, length, worker->fp);
+                    length = 0;
+                }
+                length += formatter.format(&worker->queue[tail & mask], buffer.data() + length);
+                worker->tail.store(tail + 1, std::memory_order_release);
+            }
+        }
+    }
+
+    void invokeStartHandlers()
+    {
+        for (auto handler : devices.startHandlers) handler->callback(this);
+        for (auto device : devices.instances) {
+            if (device->start) device->start(device->userData, this);
+        }
+        startOutputWorker();
+        for (auto device : devices.timedDevices) advanceDevice(device);
+        ctx.startFlag = true;
+    }
+
+    void invokeEndHandlers()
+    {
+        stopOutputWorker();
+        for (auto handler : devices.endHandlers) handler->callback(this);
+        for (auto device : devices.instances) {
+            if (device->end) device->end(device->userData, this);
+        }
+    }
+
     struct Context {
         unsigned char banks[8];
         unsigned char ramBankIndexStart;
@@ -61,7 +380,296 @@ class Z80Console
         unsigned char reserved[4];
     } ctx;
 
+    // dirty bit of each 256 bytes page in the RAM (bank x 32 pages)
+    unsigned long long ramDirtyMap[256 * 32 / 64];
+    // pages written since the last reset (reset clears only these pages)
+    unsigned long long ramTouchedMap[256 * 32 / 64];
+
+    inline void writeRam(int bank, unsigned short offset, unsigned char value)
+    {
+        ram.data[bank][offset] = value;
+        int index = bank * 32 + (offset >> 8);
+        ramDirtyMap[index >> 6] |= 1ULL << (index & 63);
+        ramTouchedMap[index >> 6] |= 1ULL << (index & 63);
+    }
+
+    int spanClocks;
+
+    // buffer of the console output (OUT 0x0B, 0x0F)
+    struct ConsoleOutput {
+        std::vector<unsigned char> buffer;
+        int length;
+        bool flushOnNewline;
+        int flushIntervalMs;
+        std::chrono::steady_clock::time_point bufferedTime;
+    } conout;
+
+    // console sink/source (not owned)
+    StdioConsoleSink stdioSink;
+    StdioConsoleSource stdioSource;
+    ConsoleSink* sink;
+    ConsoleSource* source;
+    std::vector<unsigned char> spanBuffer; // for the guest memory that is not a contiguous host memory
+
+    // console input (IN 0x0F): a line from the source (blocking) or the bytes in the ring buffer (non-blocking)
+    struct ConsoleInput {
+        bool isNonBlocking;
+        bool isPrompt;
+        unsigned char irqVector;
+        unsigned int irqHead;
+        std::vector<char> line; // the bytes after the newline are kept for the next read
+        int lineLength;
+        std::vector<unsigned char> ring;
+        std::atomic<unsigned int> head; // written by the producer (pushConsoleInput)
+        std::atomic<unsigned int> tail; // written by the consumer (IN 0x0F)
+        std::atomic<bool> eof;
+    } conin;
+
+    // read the source to the guest memory with a single read call (directly if addr~size is a contiguous host memory)
+    int readStream(unsigned short addr, int size)
+    {
+        if (size < 1) return 0;
+        if (conin.lineLength) {
+            // the rest of the line read by IN 0x0F
+            int length = conin.lineLength < size ? conin.lineLength : size;
+            writeSpan(addr, conin.line.data(), length);
+            consumeConsoleLine(length);
+            return length;
+        }
+        int length = size;
+        unsigned char* ptr = mapSpan(addr, &length, true);
+        if (ptr && length == size) {
+            int result = source->read(ptr, size);
+            if (0 < result && spanClocks) cpu->consumeExternalClock(spanClocks * result);
+            return result;
+        }
+        int result = source->read(spanBuffer.data(), size);
+        if (0 < result) writeSpan(addr, spanBuffer.data(), result);
+        return result;
+    }
+
+    // read a line from the source to conin.line and returns the length including the newline
+    int readConsoleLine()
+    {
+        int searched = 0;
+        while (true) {
+            void* newline = memchr(conin.line.data() + searched, '\n', conin.lineLength - searched);
+            if (newline) return (int)((char*)newline - conin.line.data()) + 1;
+            if (conin.lineLength == (int)conin.line.size()) return conin.lineLength;
+            searched = conin.lineLength;
+            int result = source->read(conin.line.data() + conin.lineLength, (int)conin.line.size() - conin.lineLength);
+            if (result < 1) return conin.lineLength;
+            conin.lineLength += result;
+        }
+    }
+
+    void consumeConsoleLine(int length)
+    {
+        conin.lineLength -= length;
+        if (conin.lineLength) memmove(conin.line.data(), conin.line.data() + length, conin.lineLength);
+    }
+
+    // write the guest memory to the sink (directly if addr~size is a contiguous host memory), returns the written size (less than size on error)
+    int writeStream(unsigned short addr, int size)
+    {
+        if (size < 1) return 0;
+        int length = size;
+        const unsigned char* ptr = mapSpan(addr, &length);
+        if (ptr && length == size) {
+            if (spanClocks) cpu->consumeExternalClock(spanClocks * size);
+        } else {
+            readSpan(addr, spanBuffer.data(), size);
+            ptr = spanBuffer.data();
+        }
+        for (int written = 0; written < size;) {
+            int result = sink->write(ptr + written, size - written);
+            if (result < 1) return written;
+            written += result;
+        }
+        return size;
+    }
+
+    inline int readConsoleInput(unsigned short addr, int size)
+    {
+        unsigned int tail = conin.tail.load(std::memory_order_relaxed);
+        unsigned int available = conin.head.load(std::memory_order_acquire) - tail;
+        unsigned int mask = (unsigned int)conin.ring.size() - 1;
+        int length = (int)available < size ? (int)available : size;
+        for (int total = 0; total < length;) {
+            int offset = (tail + total) & mask;
+            int chunk = (int)conin.ring.size() - offset;
+            if (length - total < chunk) chunk = length - total;
+            writeSpan(addr + total, &conin.ring[offset], chunk);
+            total += chunk;
+        }
+        conin.tail.store(tail + length, std::memory_order_release);
+        return length;
+    }
+
+    inline void checkConsoleInputIRQ()
+    {
+        unsigned int head = conin.head.load(std::memory_order_acquire);
+        if (head != conin.irqHead) {
+            conin.irqHead = head;
+            cpu->generateIRQ(conin.irqVector);
+        }
+    }
+
+    void writeConsole(unsigned short addr, int size)
+    {
+        if (conout.buffer.empty()) {
+            // unbuffered
+            writeStream(addr, size);
+            sink->flush();
+            return;
+        }
+        while (0 < size) {
+            int space = (int)conout.buffer.size() - conout.length;
+            if (space < 1) {
+                flushConsoleOutput();
+                continue;
+            }
+            int length = size < space ? size : space;
+            unsigned char* ptr = &conout.buffer[conout.length];
+            readSpan(addr, ptr, length);
+            if (0 == conout.length && conout.flushIntervalMs) conout.bufferedTime = std::chrono::steady_clock::now();
+            conout.length += length;
+            addr += length;
+            size -= length;
+            if (conout.flushOnNewline && memchr(ptr, '\n', length)) flushConsoleOutput();
+        }
+    }
+
+    inline void markRamPages(int bank, unsigned short offset, int size)
+    {
+        for (int page = offset >> 8; page <= (offset + size - 1) >> 8; page++) {
+            int index = bank * 32 + page;
+            ramDirtyMap[index >> 6] |= 1ULL << (index & 63);
+            ramTouchedMap[index >> 6] |= 1ULL << (index & 63);
+        }
+    }
+
+    inline void markRegionPages(unsigned char page, int size)
+    {
+        for (int i = 0; i < size; i += 256, page++) {
+            auto region = &devices.region[page];
+            if (!region->dirty) {
+                region->dirty = true;
+                if (region->notify) region->notify(this, page);
+            }
+        }
+    }
+
+    void clearTouchedRam()
+    {
+        for (int i = 0; i < (int)(sizeof(ramTouchedMap) / sizeof(ramTouchedMap[0])); i++) {
+            unsigned long long bits = ramTouchedMap[i];
+            if (!bits) continue;
+            for (int bit = 0; bit < 64; bit++) {
+                if (bits & (1ULL << bit)) {
+                    int index = i * 64 + bit;
+                    memset(&ram.data[index / 32][(index % 32) * 256], 0, 256);
+                }
+            }
+            ramDirtyMap[i] |= bits;
+            ramTouchedMap[i] = 0;
+        }
+    }
+
   public:
+    enum MemoryRegionFlag {
+        MEMORY_REGION_READ = 0b01,
+        MEMORY_REGION_WRITE = 0b10,
+    };
+
+    // the handler of a port (in: IN, INIR/INDR, out: OUT, OTIR/OTDR) or a memory mapped page (read: byte, word, block)
+    enum ProfileType {
+        PROFILE_IN = 0,
+        PROFILE_OUT = 1,
+        PROFILE_READ = 2,
+        PROFILE_WRITE = 3,
+    };
+
+    struct Profile {
+        unsigned long long calls;
+        unsigned long long totalNs; // the host time spent in the handler
+        unsigned long long maxNs;
+        unsigned long long totalCycles; // the emulated cycles between the accesses (calls - 1 intervals)
+        unsigned long long lastCycle;
+    };
+
+    // The counters of the guest activity since the reset (always collected: an increment per access)
+    struct Statistics {
+        unsigned long long portReads[256];  // IN (a block transfer counts the bytes)
+        unsigned long long portWrites[256]; // OUT (a block transfer counts the bytes)
+        unsigned long long mmioCalls[256];  // the calls of the memory mapped I/O handlers per page
+        unsigned long long bankSwitches;    // OUT to the bank switch ports (0x00 ~ 0x07)
+    };
+
+  private:
+    Statistics stats;
+
+    struct Profiler {
+        bool enabled;
+        Profile profiles[4][256];
+    } profiler;
+
+    struct Budget {
+        unsigned long long maxCycles;       // 0: unlimited
+        unsigned long long maxInstructions; // 0: unlimited
+        bool isExhausted;
+    } budget;
+
+    // the clocks that can be executed without exceeding the budget (0: exhausted)
+    int remainingBudget()
+    {
+        unsigned long long remain = INT_MAX;
+        if (budget.maxCycles) {
+            unsigned long long now = cpu->getClockCount();
+            if (budget.maxCycles <= now) return 0;
+            if (budget.maxCycles - now < remain) remain = budget.maxCycles - now;
+        }
+        if (budget.maxInstructions) {
+            unsigned long long count = cpu->getInstructionCount();
+            if (budget.maxInstructions <= count) return 0;
+            // an instruction takes 4 clocks at least, so the slice cannot exceed the remaining instructions
+            if ((budget.maxInstructions - count) * 4 < remain) remain = (budget.maxInstructions - count) * 4;
+        }
+        return (int)remain;
+    }
+
+    // measure a call of the handler while the scope is alive (nothing is measured if the profiling is disabled)
+    class ProfileScope
+    {
+      private:
+        Profile* profile;
+        std::chrono::steady_clock::time_point start;
+
+      public:
+        ProfileScope(Z80Console* console, ProfileType type, unsigned char number)
+        {
+            if (!console->profiler.enabled) {
+                profile = NULL;
+                return;
+            }
+            profile = &console->profiler.profiles[type][number];
+            unsigned long long cycle = console->cpu->getClockCount();
+            if (profile->calls) profile->totalCycles += cycle - profile->lastCycle;
+            profile->lastCycle = cycle;
+            profile->calls++;
+            start = std::chrono::steady_clock::now();
+        }
+        ~ProfileScope()
+        {
+            if (!profile) return;
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            profile->totalNs += ns;
+            if (profile->maxNs < (unsigned long long)ns) profile->maxNs = ns;
+        }
+    };
+
+  public:
+
     struct Memory {
         int count;
         unsigned char data[256][8192];
@@ -70,47 +678,369 @@ class Z80Console
     struct Memory ram;
     Z80* cpu;
 
-    Z80Console()
+    Z80Console() : devices(), traceSink(this) // zero-initialize the device tables
     {
         cpu = new Z80(readMemory, writeMemory, inPort, outPort, this);
+        cpu->setWordAccessCallback(readMemory16, writeMemory16);
+        cpu->setBlockCopyCallback(copyMemory);
+        cpu->setBlockIOCallback(inPortBlock, outPortBlock);
         cpu->addReturnHandler([](void* arg) {
             auto _this = (Z80Console*)arg;
             // Shutdown the ConsoleComputer when call the RET instruction when SP equals 0
             if (0 == _this->cpu->reg.SP) {
-                for (auto handler : _this->devices.endHandlers) handler->callback(arg);
+                _this->flushConsoleOutput();
+                _this->invokeEndHandlers();
                 _this->ctx.endFlag = true;
                 _this->cpu->requestBreak();
             }
         });
         rom.count = 0;
         memset(rom.data, 0, sizeof(rom.data));
+        memset(ram.data, 0, sizeof(ram.data));
+        memset(ramDirtyMap, 0xFF, sizeof(ramDirtyMap));
+        memset(ramTouchedMap, 0, sizeof(ramTouchedMap));
         ram.count = 256;
         ctx.ramBankIndexStart = 4;
         ctx.ramBankIndexEnd = 7;
+        ctx.startFlag = false;
         ctx.endFlag = false;
+        spanClocks = 0;
+        conout.length = 0;
+        conout.flushOnNewline = true;
+        conout.flushIntervalMs = 0;
+        setConsoleOutputBuffer(0x10000);
+        conin.isNonBlocking = false;
+        conin.isPrompt = true;
+        conin.irqVector = 0;
+        conin.irqHead = 0;
+        conin.ring.resize(0x10000);
+        conin.head = 0;
+        conin.tail = 0;
+        conin.eof = false;
+        conin.line.resize(0x10000);
+        conin.lineLength = 0;
+        sink = &stdioSink;
+        source = &stdioSource;
+        spanBuffer.resize(0x10000);
+        lastEventId = 0;
+        sliceEnd = 0;
+        isSliceBroken = false;
+        memset(&profiler, 0, sizeof(profiler));
+        memset(&budget, 0, sizeof(budget));
+        memset(outputWorker.isAsync, 0, sizeof(outputWorker.isAsync));
+        outputWorker.cycle = 0;
+        outputWorker.dropped = 0;
+        setOutputWorkerQueue(4096);
+        traceWorker.fp = NULL;
+        traceWorker.queue.resize(TRACE_QUEUE_SIZE);
+        traceWorker.head = 0;
+        traceWorker.tail = 0;
+        traceWorker.running = false;
+        traceWorker.sink = NULL;
         reset();
     }
 
     ~Z80Console()
     {
+        stopOutputWorker();
+        flushConsoleOutput();
+        setTrace(NULL);
         for (auto handler : devices.startHandlers) delete handler;
         devices.startHandlers.clear();
         for (auto handler : devices.endHandlers) delete handler;
         devices.endHandlers.clear();
+        for (auto device : devices.instances) {
+            if (device->destroy) device->destroy(device->userData);
+            delete device;
+        }
+        devices.instances.clear();
+        for (auto device : devices.timedDevices) delete device;
+        devices.timedDevices.clear();
         if (cpu) delete cpu;
     }
 
+    /**
+     * Reset the CPU and the RAM while keeping the ROM and the registered devices.
+     * Only the RAM pages written by the CPU (or writeSpan/mapSpan) since the last reset are cleared,
+     * so the host must not write ram.data directly if it expects reset to clear them.
+     * The unread console input (the rest of a line and the bytes pushed by pushConsoleInput) is discarded
+     * and the EOF by closeConsoleInput is cleared, so the host pushes the input of the next run after reset.
+     */
     void reset()
     {
-        memset(&devices, 0, sizeof(devices));
-        memset(ram.data, 0, sizeof(ram.data));
+        if (ctx.startFlag && !ctx.endFlag) {
+            invokeEndHandlers();
+        }
+        ctx.startFlag = false;
+        ctx.endFlag = false;
+        budget.isExhausted = false;
+        memset(&stats, 0, sizeof(stats));
+        flushConsoleOutput();
+        clearTouchedRam();
         memset(&cpu->reg, 0, sizeof(cpu->reg));
+        cpu->resetClockCount();
+        events.clear();
         resetBanks(ctx.ramBankIndexStart, ctx.ramBankIndexEnd);
-        ctx.startFlag = false;
-        if (ctx.endFlag) {
-            for (auto handler : devices.endHandlers) handler->callback(this);
-            ctx.endFlag = false;
+        // the producer may still push, so only the consumer side of the ring buffer is moved
+        conin.lineLength = 0;
+        conin.irqVector = 0;
+        conin.tail.store(conin.head.load(std::memory_order_acquire), std::memory_order_release);
+        conin.irqHead = conin.tail.load(std::memory_order_relaxed);
+        conin.eof.store(false, std::memory_order_release);
+        outputWorker.dropped = 0;
+    }
+
+    /**
+     * The dirty bit of a RAM page (256 bytes) is set when the CPU writes the page or reset clears the page.
+     * Bit (bank * 32 + offset / 256) of getRamDirtyMap() corresponds to ram.data[bank][offset].
+     */
+    const unsigned long long* getRamDirtyMap() { return ramDirtyMap; }
+    int getRamDirtyMapSize() { return (int)(sizeof(ramDirtyMap) / sizeof(ramDirtyMap[0])); }
+    bool isRamPageDirty(int bank, int offset)
+    {
+        int index = (bank & 0xFF) * 32 + ((offset & 0x1FFF) >> 8);
+        return ramDirtyMap[index >> 6] & (1ULL << (index & 63));
+    }
+    void clearRamDirtyMap() { memset(ramDirtyMap, 0, sizeof(ramDirtyMap)); }
+
+    /**
+     * Get the host pointer of the guest memory at addr under the current memory map.
+     * size is shrunk to the length of the contiguous host memory (without wrap around of the address),
+     * and NULL is returned if addr is mapped to a callback device (or to the ROM when isWrite).
+     */
+    unsigned char* mapSpan(unsigned short addr, int* size, bool isWrite = false)
+    {
+        int max = 0x10000 - addr;
+        if (*size < max) max = *size;
+        unsigned char page = (addr & 0xFF00) >> 8;
+        unsigned char flag = isWrite ? MEMORY_REGION_WRITE : MEMORY_REGION_READ;
+        int length = 0x100 - (addr & 0xFF);
+        unsigned char* ptr = NULL;
+        if (devices.region[page].flags & flag) {
+            for (int p = page + 1; length < max && p < 256; p++, length += 0x100) {
+                if (!(devices.region[p].flags & flag) || devices.region[p].ptr != devices.region[p - 1].ptr + 0x100) break;
+            }
+            if (max < length) length = max;
+            ptr = devices.region[page].ptr + (addr & 0xFF);
+            if (isWrite) markRegionPages(page, (addr & 0xFF) + length);
+        } else if (!(isWrite ? (void*)devices.write[page] : (void*)devices.read[page])) {
+            for (int p = page + 1; length < max && (p & 0x1F); p++, length += 0x100) {
+                if ((devices.region[p].flags & flag) || (isWrite ? (void*)devices.write[p] : (void*)devices.read[p])) break;
+            }
+            if (max < length) length = max;
+            int n = (addr & 0xE000) >> 13;
+            if (isRamIndex(n)) {
+                ptr = &ram.data[n % ram.count][addr & 0x1FFF];
+                if (isWrite) markRamPages(n % ram.count, addr & 0x1FFF, length);
+            } else if (!isWrite && 0 < rom.count) {
+                ptr = &rom.data[n % rom.count][addr & 0x1FFF];
+            }
+        } else if (max < length) {
+            length = max;
+        }
+        *size = length;
+        return ptr;
+    }
+
+    // Copy the guest memory from addr to buf (callback devices are read by the block or byte callbacks)
+    int readSpan(unsigned short addr, void* buf, int size)
+    {
+        unsigned char* dst = (unsigned char*)buf;
+        for (int total = 0; total < size;) {
+            int length = size - total;
+            const unsigned char* ptr = mapSpan(addr, &length);
+            if (ptr) {
+                memcpy(dst + total, ptr, length);
+            } else {
+                unsigned char page = (addr & 0xFF00) >> 8;
+                if (devices.readBlock[page] && devices.read[page]) {
+                    devices.readBlock[page](this, addr, dst + total, length);
+                } else if (devices.read[page]) {
+                    for (int i = 0; i < length; i++) dst[total + i] = devices.read[page](this, addr + i);
+                } else {
+                    memset(dst + total, 0xFF, length);
+                }
+            }
+            total += length;
+            addr += length;
+        }
+        if (spanClocks) cpu->consumeExternalClock(spanClocks * size);
+        return size;
+    }
+
+    // Copy buf to the guest memory from addr (writes to the ROM are ignored)
+    int writeSpan(unsigned short addr, const void* buf, int size)
+    {
+        const unsigned char* src = (const unsigned char*)buf;
+        for (int total = 0; total < size;) {
+            int length = size - total;
+            unsigned char* ptr = mapSpan(addr, &length, true);
+            if (ptr) {
+                memcpy(ptr, src + total, length);
+            } else {
+                unsigned char page = (addr & 0xFF00) >> 8;
+                if (devices.writeBlock[page] && devices.write[page]) {
+                    devices.writeBlock[page](this, addr, src + total, length);
+                } else if (devices.write[page]) {
+                    for (int i = 0; i < length; i++) devices.write[page](this, addr + i, src[total + i]);
+                }
+            }
+            total += length;
+            addr += length;
+        }
+        if (spanClocks) cpu->consumeExternalClock(spanClocks * size);
+        return size;
+    }
+
+    // Clocks consumed per byte by readSpan and writeSpan (default: 0)
+    void setSpanClocks(int clocksPerByte) { spanClocks = clocksPerByte; }
+
+    /**
+     * The console output is flushed when the buffer is full, a newline is written (if flushOnNewline),
+     * the buffered data gets older than flushIntervalMs (if not 0, checked at the end of execute) and the console ends.
+     * If size is 0, the output is written to the sink directly from the guest memory without buffering.
+     */
+    void setConsoleOutputBuffer(int size, bool flushOnNewline = true, int flushIntervalMs = 0)
+    {
+        flushConsoleOutput();
+        conout.buffer.resize(size < 1 ? 0 : size);
+        conout.flushOnNewline = flushOnNewline;
+        conout.flushIntervalMs = flushIntervalMs;
+    }
+
+    void flushConsoleOutput()
+    {
+        if (conout.length < 1) return;
+        for (int written = 0; written < conout.length;) {
+            int result = sink->write(conout.buffer.data() + written, conout.length - written);
+            if (result < 1) break;
+            written += result;
+        }
+        sink->flush();
+        conout.length = 0;
+    }
+
+    /**
+     * In the non-blocking mode, IN 0x0F copies the bytes pushed by pushConsoleInput (typically from a reader thread)
+     * without waiting and returns the copied size in BC (as IN 0x0C), and port 0x0E provides the input status and the IRQ
+     * on data arrival.
+     */
+    void setConsoleInputMode(bool isNonBlocking, bool isPrompt = true)
+    {
+        conin.isNonBlocking = isNonBlocking;
+        conin.isPrompt = isPrompt;
+    }
+
+    // Push the console input to the ring buffer (thread safe with a single producer), returns the pushed size
+    int pushConsoleInput(const void* data, int size)
+    {
+        unsigned int head = conin.head.load(std::memory_order_relaxed);
+        unsigned int space = (unsigned int)conin.ring.size() - (head - conin.tail.load(std::memory_order_acquire));
+        unsigned int mask = (unsigned int)conin.ring.size() - 1;
+        int length = (int)space < size ? (int)space : size;
+        for (int i = 0; i < length; i++) conin.ring[(head + i) & mask] = ((const unsigned char*)data)[i];
+        conin.head.store(head + length, std::memory_order_release);
+        return length;
+    }
+
+    void closeConsoleInput() { conin.eof.store(true, std::memory_order_release); }
+
+    /**
+     * Set the destination of OUT 0x0B/0x0D/0x0F and the origin of IN 0x0C/0x0F (NULL: stdout/stdin with stdio).
+     * The sink and the source are not owned by the console, and they must live while the console uses them.
+     */
+    void setConsoleSink(ConsoleSink* sink)
+    {
+        flushConsoleOutput();
+        this->sink = sink ? sink : &stdioSink;
+    }
+    void setConsoleSource(ConsoleSource* source)
+    {
+        this->source = source ? source : &stdioSource;
+        conin.lineLength = 0;
+    }
+
+    /**
+     * Count the calls, the host time and the emulated cycles between the accesses of each plugin handler (disabled by default).
+     * The counters are kept while disabled, and cleared by resetProfile.
+     */
+    void setProfiling(bool enabled) { profiler.enabled = enabled; }
+    bool isProfiling() { return profiler.enabled; }
+    void resetProfile() { memset(profiler.profiles, 0, sizeof(profiler.profiles)); }
+    const Profile* getProfile(ProfileType type, unsigned char number) { return &profiler.profiles[type][number]; }
+
+    // Print the handlers called at least once in descending order of the total host time
+    void printProfile(FILE* fp)
+    {
+        static const char* typeNames[4] = {"in", "out", "read", "write"};
+        std::vector<std::pair<int, int>> called; // type, number
+        for (int type = 0; type < 4; type++) {
+            for (int number = 0; number < 256; number++) {
+                if (profiler.profiles[type][number].calls) called.push_back(std::make_pair(type, number));
+            }
+        }
+        std::sort(called.begin(), called.end(), [this](const std::pair<int, int>& a, const std::pair<int, int>& b) {
+            return profiler.profiles[b.first][b.second].totalNs < profiler.profiles[a.first][a.second].totalNs;
+        });
+        fprintf(fp, "%-5s %-5s %12s %14s %10s %10s %14s\n", "type", "port", "calls", "total(ns)", "avg(ns)", "max(ns)", "avg(cycles)");
+        for (auto& entry : called) {
+            auto profile = &profiler.profiles[entry.first][entry.second];
+            fprintf(fp, "%-5s %s%02X%s %12llu %14llu %10llu %10llu %14llu\n",
+                    typeNames[entry.first],
+                    entry.first < PROFILE_READ ? "" : "$",
+                    entry.second,
+                    entry.first < PROFILE_READ ? "   " : "00",
+                    profile->calls,
+                    profile->totalNs,
+                    profile->totalNs / profile->calls,
+                    profile->maxNs,
+                    1 < profile->calls ? profile->totalCycles / (profile->calls - 1) : 0);
+        }
+    }
+
+    /**
+     * Trace the executed instructions matching the filter to fp (NULL: stop the trace after writing the queued records).
+     * The CPU pushes a fixed-size raw record (PC, instruction bytes, registers and cycle) into the ring buffer, and the worker
+     * thread disassembles and writes them with large buffered writes (the CPU waits while the ring buffer is full).
+     * isConsoleOutput writes the console output into the trace in order (for the sink that writes to the same stream as fp).
+     */
+    void setTrace(FILE* fp, const TraceFilter& filter = TraceFilter(), bool isConsoleOutput = false)
+    {
+        if (traceWorker.thread.joinable()) {
+            flushConsoleOutput();
+            cpu->setTraceHandler(NULL);
+            traceWorker.running.store(false, std::memory_order_release);
+            traceWorker.thread.join();
+            if (traceWorker.sink && sink == &traceSink) sink = traceWorker.sink;
+            traceWorker.sink = NULL;
+            traceWorker.fp = NULL;
+        }
+        if (!fp) return;
+        traceWorker.fp = fp;
+        traceWorker.filter = filter;
+        traceWorker.head = 0;
+        traceWorker.tail = 0;
+        traceWorker.running = true;
+        traceWorker.thread = std::thread(runTraceWorker, this);
+        if (isConsoleOutput) {
+            flushConsoleOutput();
+            traceWorker.sink = sink;
+            sink = &traceSink;
+        }
+        cpu->setTraceHandler(traceInstruction);
+    }
+
+    const Statistics& getStatistics() { return stats; }
+
+    // the RAM banks written since the reset (the peak, since reset is the only way to release them)
+    int getTouchedRamBanks()
+    {
+        int banks = 0;
+        for (int i = 0; i < ram.count; i++) {
+            unsigned long long mask = 0xFFFFFFFFULL << ((i & 1) * 32);
+            if (ramTouchedMap[i >> 1] & mask) banks++;
         }
+        return banks;
     }
 
     bool isEnded() { return this->ctx.endFlag; }
@@ -121,21 +1051,127 @@ class Z80Console
     bool addOutputDevice(unsigned char portNumber, void (*out)(void*, unsigned char, unsigned char))
     {
         if (ctx.startFlag) return false;
+        if (devices.port[portNumber]) devices.port[portNumber]->capabilities &= ~Z80CONSOLE_DEVICE_OUT;
         devices.out[portNumber] = out;
         return true;
     }
 
+    /**
+     * Make the OUT to the output device of portNumber processed on the worker thread (opt-in).
+     * The OUTs are queued with the cycle (getOutputDeviceCycle) in order across the ports, and IN from the devices waits for the queue.
+     * The device must not access the console or the CPU in the out callback except getOutputDeviceCycle.
+     */
+    bool setOutputDeviceAsync(unsigned char portNumber, bool isAsync = true)
+    {
+        if (ctx.startFlag) return false;
+        outputWorker.isAsync[portNumber] = isAsync;
+        return true;
+    }
+
+    bool hasAsyncOutputDevice()
+    {
+        for (int i = 0; i < 256; i++) {
+            if (outputWorker.isAsync[i] && devices.out[i]) return true;
+        }
+        return false;
+    }
+
+    // The queue size is rounded up to a power of 2. When the queue is full, OUT waits for the worker or drops the value (isDropOnFull).
+    bool setOutputWorkerQueue(int size, bool isDropOnFull = false)
+    {
+        if (ctx.startFlag) return false;
+        unsigned int queueSize = 1;
+        while ((int)queueSize < size) queueSize <<= 1;
+        outputWorker.queue.resize(queueSize);
+        outputWorker.isDropOnFull = isDropOnFull;
+        return true;
+    }
+
+    unsigned long long getOutputDeviceCycle() { return outputWorker.cycle; }
+    unsigned long long getOutputWorkerDroppedCount() { return outputWorker.dropped; }
+
     bool addInputDevice(unsigned char portNumber, unsigned char (*in)(void*, unsigned char))
     {
         if (ctx.startFlag) return false;
+        if (devices.port[portNumber]) devices.port[portNumber]->capabilities &= ~Z80CONSOLE_DEVICE_IN;
         devices.in[portNumber] = in;
         return true;
     }
 
+    /**
+     * Add a descriptor-based device to portCount ports from portNumber (the descriptor is copied).
+     * The callbacks not declared in device->capabilities are not used, and the ports declared are taken from addInputDevice/addOutputDevice.
+     */
+    bool addDevice(unsigned char portNumber, const Z80ConsoleDevice* device, int portCount = 1)
+    {
+        if (ctx.startFlag || !device || Z80CONSOLE_DEVICE_VERSION != device->version) return false;
+        if (portCount < 1 || 256 < portNumber + portCount) return false;
+        auto instance = new Z80ConsoleDevice(*device);
+        if (!instance->in) instance->capabilities &= ~Z80CONSOLE_DEVICE_IN;
+        if (!instance->out) instance->capabilities &= ~Z80CONSOLE_DEVICE_OUT;
+        if (!instance->inBlock) instance->capabilities &= ~Z80CONSOLE_DEVICE_IN_BLOCK;
+        if (!instance->outBlock) instance->capabilities &= ~Z80CONSOLE_DEVICE_OUT_BLOCK;
+        if (!instance->tick) instance->capabilities &= ~Z80CONSOLE_DEVICE_TICK;
+        if (!instance->advanceTo) instance->capabilities &= ~Z80CONSOLE_DEVICE_ADVANCE;
+        devices.instances.push_back(instance);
+        if (instance->capabilities & Z80CONSOLE_DEVICE_ADVANCE) {
+            addTimedDevice(portNumber, portCount, instance->userData, instance->advanceTo);
+        }
+        for (int port = portNumber; port < portNumber + portCount; port++) {
+            devices.port[port] = instance;
+            if (instance->capabilities & Z80CONSOLE_DEVICE_IN) devices.in[port] = NULL;
+            if (instance->capabilities & Z80CONSOLE_DEVICE_OUT) devices.out[port] = NULL;
+        }
+        return true;
+    }
+
+    /**
+     * Add the catch-up timing to the input/output devices of portCount ports from portNumber (ctx of advanceTo is the Z80Console).
+     * advanceTo catches up the device state to the cycle (getClockCount of the CPU) and returns the next deadline (0: none).
+     * It is called at the start, before each IN/OUT to the ports and when the deadline is reached (the CPU runs up to the deadline).
+     */
+    bool addAdvanceHandler(unsigned char portNumber, unsigned long long (*advanceTo)(void*, unsigned long long), int portCount = 1)
+    {
+        if (ctx.startFlag || !advanceTo || portCount < 1 || 256 < portNumber + portCount) return false;
+        addTimedDevice(portNumber, portCount, this, advanceTo);
+        return true;
+    }
+
+    /**
+     * Schedule the callback at the cycle (getClockCount of the CPU), and returns the event id to cancel.
+     * The CPU runs up to the cycle of the next event (at the instruction boundary) and fires it, so the callback can generate
+     * an interrupt or schedule the next period at cycle + period. The scheduled events are cleared by reset.
+     */
+    int schedule(unsigned long long cycle, void (*callback)(void* arg, unsigned long long cycle), void* arg = NULL)
+    {
+        Event event;
+        event.cycle = cycle;
+        event.id = ++lastEventId;
+        event.callback = callback;
+        event.arg = arg;
+        events.push_back(event);
+        std::push_heap(events.begin(), events.end());
+        breakSliceAt(cycle);
+        return event.id;
+    }
+
+    bool cancel(int id)
+    {
+        for (auto itr = events.begin(); itr != events.end(); itr++) {
+            if (itr->id == id) {
+                events.erase(itr);
+                std::make_heap(events.begin(), events.end());
+                return true;
+            }
+        }
+        return false;
+    }
+
     bool addWriteMemoryMap(unsigned short address, void (*write)(void*, unsigned short, unsigned char))
     {
         if (ctx.startFlag) return false;
         devices.write[(address & 0xFF00) >> 8] = write;
+        devices.region[(address & 0xFF00) >> 8].flags &= ~MEMORY_REGION_WRITE;
         return true;
     }
 
@@ -143,9 +1179,62 @@ class Z80Console
     {
         if (ctx.startFlag) return false;
         devices.read[(address & 0xFF00) >> 8] = read;
+        devices.region[(address & 0xFF00) >> 8].flags &= ~MEMORY_REGION_READ;
+        return true;
+    }
+
+    // The word and block callbacks are used instead of the byte callback when an access fits in the page
+    bool addWriteMemoryMap16(unsigned short address, void (*write16)(void*, unsigned short, unsigned short))
+    {
+        if (ctx.startFlag) return false;
+        devices.write16[(address & 0xFF00) >> 8] = write16;
         return true;
     }
 
+    bool addReadMemoryMap16(unsigned short address, unsigned short (*read16)(void*, unsigned short))
+    {
+        if (ctx.startFlag) return false;
+        devices.read16[(address & 0xFF00) >> 8] = read16;
+        return true;
+    }
+
+    bool addWriteBlockMemoryMap(unsigned short address, void (*writeBlock)(void*, unsigned short, const unsigned char*, unsigned short))
+    {
+        if (ctx.startFlag) return false;
+        devices.writeBlock[(address & 0xFF00) >> 8] = writeBlock;
+        return true;
+    }
+
+    bool addReadBlockMemoryMap(unsigned short address, void (*readBlock)(void*, unsigned short, unsigned char*, unsigned short))
+    {
+        if (ctx.startFlag) return false;
+        devices.readBlock[(address & 0xFF00) >> 8] = readBlock;
+        return true;
+    }
+
+    /**
+     * Map a host buffer (pageCount x 256 bytes) to the pages from startPage.
+     * The CPU reads and writes the buffer directly without calling back the device,
+     * and the first write to a clean page sets its dirty flag and invokes notify (if specified).
+     */
+    bool addMemoryRegion(unsigned char startPage, int pageCount, unsigned char* hostPointer, int flags = MEMORY_REGION_READ | MEMORY_REGION_WRITE, void (*notify)(void*, unsigned char) = NULL)
+    {
+        if (ctx.startFlag || !hostPointer) return false;
+        for (int page = startPage; page < 256 && page < startPage + pageCount; page++) {
+            auto region = &devices.region[page];
+            region->ptr = hostPointer + (page - startPage) * 256;
+            region->flags = flags & (MEMORY_REGION_READ | MEMORY_REGION_WRITE);
+            region->dirty = false;
+            region->notify = notify;
+            if (flags & MEMORY_REGION_READ) devices.read[page] = NULL;
+            if (flags & MEMORY_REGION_WRITE) devices.write[page] = NULL;
+        }
+        return true;
+    }
+
+    bool isMemoryRegionDirty(unsigned char page) { return devices.region[page].dirty; }
+    void clearMemoryRegionDirty(unsigned char page) { devices.region[page].dirty = false; }
+
     bool addStartHandler(void (*handler)(void*))
     {
         if (ctx.startFlag) return false;
@@ -173,6 +1262,14 @@ class Z80Console
         return true;
     }
 
+    // Remove the ROM data to load another program (after reset)
+    bool clearRomData()
+    {
+        if (ctx.startFlag) return false;
+        rom.count = 0;
+        return true;
+    }
+
     bool addRomData(const void* data, int dataSize)
     {
         if (ctx.startFlag) return false;
@@ -222,11 +1319,85 @@ class Z80Console
     int execute(int clocks)
     {
         if (rom.count < 1 || ctx.endFlag) return 0;
-        if (!ctx.startFlag) {
-            for (auto handler : devices.startHandlers) handler->callback(this);
-            ctx.startFlag = true;
+        if (!ctx.startFlag) invokeStartHandlers();
+        // execute in the slices up to the next event or device deadline (and check the console input to generate the IRQ on data arrival)
+        int executed = 0;
+        while (executed < clocks && !ctx.endFlag) {
+            int slice = clocks - executed;
+            if (budget.maxCycles || budget.maxInstructions) {
+                int remain = remainingBudget();
+                if (remain < 1) {
+                    budget.isExhausted = true;
+                    break;
+                }
+                if (remain < slice) slice = remain;
+            }
+            if (!events.empty()) {
+                int next = fireEvents();
+                if (ctx.endFlag) break;
+                if (next < slice) slice = next < 1 ? 1 : next;
+            }
+            if (!devices.timedDevices.empty()) {
+                int next = advanceDevices();
+                if (next < slice) slice = next < 1 ? 1 : next;
+            }
+            if (conin.irqVector) {
+                checkConsoleInputIRQ();
+                if (4096 < slice) slice = 4096;
+            }
+            sliceEnd = cpu->getClockCount() + slice;
+            isSliceBroken = false;
+            int result = cpu->execute(slice);
+            sliceEnd = 0;
+            executed += result;
+            if (result < 1 || (result < slice && !isSliceBroken)) break; // requestBreak by the host
         }
-        return cpu->execute(clocks);
+        for (auto device : devices.instances) {
+            if (device->capabilities & Z80CONSOLE_DEVICE_TICK) device->tick(device->userData, executed);
+        }
+        if (conout.length && conout.flushIntervalMs) {
+            auto elapsed = std::chrono::steady_clock::now() - conout.bufferedTime;
+            if (std::chrono::milliseconds(conout.flushIntervalMs) <= elapsed) flushConsoleOutput();
+        }
+        return executed;
+    }
+
+    /**
+     * Stop the execution when the total clocks or instructions (since the reset) reach the budget (0: unlimited).
+     * The budget shortens the execution slices instead of being checked per instruction: the cycle budget stops at the first
+     * instruction boundary at or after the cycle, and the instructions are counted except while the CPU is halted.
+     * execute returns early (and isBudgetExhausted returns true) when the budget is exhausted.
+     */
+    void setBudget(unsigned long long maxCycles, unsigned long long maxInstructions)
+    {
+        budget.maxCycles = maxCycles;
+        budget.maxInstructions = maxInstructions;
+        budget.isExhausted = false;
+    }
+
+    bool isBudgetExhausted() { return budget.isExhausted; }
+
+    /**
+     * Execute until the CPU reaches the address pc (before executing the instruction at pc, -1: none) or the cycle (at the
+     * instruction boundary, 0: none), e.g. to initialize the state once and fork the process at the checkpoint.
+     * The devices are started even if the checkpoint is the first instruction.
+     * The worker thread of the async output devices (hasAsyncOutputDevice) is not inherited by a forked process.
+     * Returns false if the program ends or stops by an invalid instruction before the checkpoint.
+     */
+    bool runToCheckpoint(int pc, unsigned long long cycle = 0)
+    {
+        if (rom.count < 1 || ctx.endFlag) return false;
+        if (!ctx.startFlag) invokeStartHandlers();
+        if (pc < 0 && !cycle) return true;
+        while (!ctx.endFlag) {
+            if (0 <= pc && cpu->reg.PC == pc) return true;
+            unsigned long long now = cpu->getClockCount();
+            if (cycle && cycle <= now) return true;
+            int clocks = 1; // step an instruction to stop at the address
+            if (pc < 0) clocks = cycle - now < INT_MAX ? (int)(cycle - now) : INT_MAX;
+            if (execute(clocks) < 1) return false;
+        }
+        return false;
     }
 
     inline static unsigned char readMemory(void* ctx, unsigned short addr)
@@ -234,7 +1405,12 @@ class Z80Console
         auto _this = (Z80Console*)ctx;
         if (!_this->ctx.startFlag || _this->ctx.endFlag) return 0xFF;
         unsigned char page = (addr & 0xFF00) >> 8;
+        if (_this->devices.region[page].flags & MEMORY_REGION_READ) {
+            return _this->devices.region[page].ptr[addr & 0xFF];
+        }
         if (_this->devices.read[page]) {
+            _this->stats.mmioCalls[page]++;
+            ProfileScope profile(_this, PROFILE_READ, page);
             return _this->devices.read[page](ctx, addr);
         }
         int n = (addr & 0xE000) >> 13;
@@ -250,37 +1426,175 @@ class Z80Console
         auto _this = (Z80Console*)ctx;
         if (!_this->ctx.startFlag || _this->ctx.endFlag) return;
         unsigned char page = (addr & 0xFF00) >> 8;
+        if (_this->devices.region[page].flags & MEMORY_REGION_WRITE) {
+            auto region = &_this->devices.region[page];
+            region->ptr[addr & 0xFF] = value;
+            if (!region->dirty) {
+                region->dirty = true;
+                if (region->notify) region->notify(ctx, page);
+            }
+            return;
+        }
         if (_this->devices.write[page]) {
+            _this->stats.mmioCalls[page]++;
+            ProfileScope profile(_this, PROFILE_WRITE, page);
             _this->devices.write[page](ctx, addr, value);
             return;
         }
         int n = (addr & 0xE000) >> 13;
-        if (_this->isRamIndex(n)) _this->ram.data[n % _this->ram.count][addr & 0x1FFF] = value;
+        if (_this->isRamIndex(n)) _this->writeRam(n % _this->ram.count, addr & 0x1FFF, value);
+    }
+
+    inline static unsigned short readMemory16(void* ctx, unsigned short addr)
+    {
+        auto _this = (Z80Console*)ctx;
+        unsigned char page = (addr & 0xFF00) >> 8;
+        if (_this->devices.read16[page] && _this->devices.read[page] && 0xFF != (addr & 0xFF)) {
+            if (!_this->ctx.startFlag || _this->ctx.endFlag) return 0xFFFF;
+            _this->stats.mmioCalls[page]++;
+            ProfileScope profile(_this, PROFILE_READ, page);
+            return _this->devices.read16[page](ctx, addr);
+        }
+        unsigned short l = readMemory(ctx, addr);
+        return l | (readMemory(ctx, addr + 1) << 8);
+    }
+
+    inline static void writeMemory16(void* ctx, unsigned short addr, unsigned short value)
+    {
+        auto _this = (Z80Console*)ctx;
+        unsigned char page = (addr & 0xFF00) >> 8;
+        if (_this->devices.write16[page] && _this->devices.write[page] && 0xFF != (addr & 0xFF)) {
+            if (!_this->ctx.startFlag || _this->ctx.endFlag) return;
+            _this->stats.mmioCalls[page]++;
+            ProfileScope profile(_this, PROFILE_WRITE, page);
+            _this->devices.write16[page](ctx, addr, value);
+            return;
+        }
+        // written in order of high -> low as the baseline pushWord (the device of the byte callback sees the same order)
+        writeMemory(ctx, addr + 1, (value & 0xFF00) >> 8);
+        writeMemory(ctx, addr, value & 0x00FF);
+    }
+
+    inline static int copyMemory(void* ctx, unsigned short dst, unsigned short src, int size)
+    {
+        auto _this = (Z80Console*)ctx;
+        if (!_this->ctx.startFlag || _this->ctx.endFlag) return -1;
+        unsigned char srcPage = (src & 0xFF00) >> 8;
+        unsigned char dstPage = (dst & 0xFF00) >> 8;
+        bool isReadBlock = _this->devices.readBlock[srcPage] && _this->devices.read[srcPage];
+        bool isWriteBlock = _this->devices.writeBlock[dstPage] && _this->devices.write[dstPage];
+        if (!isReadBlock && !isWriteBlock) return -1; // copy byte by byte if not a block device
+        unsigned char buf[256];
+        if (isReadBlock) {
+            _this->stats.mmioCalls[srcPage]++;
+            ProfileScope profile(_this, PROFILE_READ, srcPage);
+            _this->devices.readBlock[srcPage](ctx, src, buf, size);
+        } else {
+            for (int i = 0; i < size; i++) buf[i] = readMemory(ctx, src + i);
+        }
+        if (isWriteBlock) {
+            _this->stats.mmioCalls[dstPage]++;
+            ProfileScope profile(_this, PROFILE_WRITE, dstPage);
+            _this->devices.writeBlock[dstPage](ctx, dst, buf, size);
+        } else {
+            for (int i = 0; i < size; i++) writeMemory(ctx, dst + i, buf[i]);
+        }
+        return buf[size - 1];
+    }
+
+    inline static int inPortBlock(void* ctx, unsigned char portNumber, unsigned short addr, int size, bool isIncrement)
+    {
+        auto _this = (Z80Console*)ctx;
+        if (!_this->ctx.startFlag || _this->ctx.endFlag) return -1;
+        auto device = _this->devices.port[portNumber];
+        if (!device || !(device->capabilities & Z80CONSOLE_DEVICE_IN_BLOCK)) return -1; // input byte by byte
+        _this->stats.portReads[portNumber] += size;
+        if (_this->devices.timed[portNumber]) _this->advanceDevice(_this->devices.timed[portNumber]);
+        if (_this->outputWorker.thread.joinable()) _this->waitOutputWorker(); // the device sees the queued OUTs as inPort
+        unsigned char buf[256];
+        {
+            ProfileScope profile(_this, PROFILE_IN, portNumber);
+            device->inBlock(device->userData, portNumber, buf, size);
+        }
+        for (int i = 0; i < size; i++) writeMemory(ctx, isIncrement ? addr + i : addr - i, buf[i]);
+        return buf[size - 1];
+    }
+
+    inline static int outPortBlock(void* ctx, unsigned char portNumber, unsigned short addr, int size, bool isIncrement)
+    {
+        auto _this = (Z80Console*)ctx;
+        if (!_this->ctx.startFlag || _this->ctx.endFlag) return -1;
+        auto device = _this->devices.port[portNumber];
+        if (!device || !(device->capabilities & Z80CONSOLE_DEVICE_OUT_BLOCK)) return -1; // output byte by byte
+        _this->stats.portWrites[portNumber] += size;
+        if (_this->devices.timed[portNumber]) _this->advanceDevice(_this->devices.timed[portNumber]);
+        unsigned char buf[256];
+        for (int i = 0; i < size; i++) buf[i] = readMemory(ctx, isIncrement ? addr + i : addr - i);
+        ProfileScope profile(_this, PROFILE_OUT, portNumber);
+        device->outBlock(device->userData, portNumber, buf, size);
+        return buf[size - 1];
     }
 
     inline static unsigned char inPort(void* ctx, unsigned char portNumber)
     {
         auto _this = (Z80Console*)ctx;
         if (!_this->ctx.startFlag || _this->ctx.endFlag) return 0xFF;
-        if (_this->devices.in[portNumber]) {
+        _this->stats.portReads[portNumber]++;
+        if (_this->devices.timed[portNumber]) _this->advanceDevice(_this->devices.timed[portNumber]);
+        auto device = _this->devices.port[portNumber];
+        if (device && (device->capabilities & Z80CONSOLE_DEVICE_IN)) {
+            if (_this->outputWorker.thread.joinable()) _this->waitOutputWorker();
+            ProfileScope profile(_this, PROFILE_IN, portNumber);
+            return device->in(device->userData, portNumber);
+        } else if (_this->devices.in[portNumber]) {
+            if (_this->outputWorker.thread.joinable()) _this->waitOutputWorker();
+            ProfileScope profile(_this, PROFILE_IN, portNumber);
             return _this->devices.in[portNumber](_this->cpu, portNumber);
         } else {
             if (portNumber < 8) return _this->ctx.banks[portNumber];
+            if (0x0C == portNumber) {
+                unsigned short addr = _this->cpu->reg.pair.H;
+                addr <<= 8;
+                addr |= _this->cpu->reg.pair.L;
+                unsigned short size = _this->cpu->reg.pair.B;
+                size <<= 8;
+                size |= _this->cpu->reg.pair.C;
+                int result = _this->readStream(addr, size);
+                int length = 0 < result ? result : 0;
+                _this->cpu->reg.pair.B = (length & 0xFF00) >> 8;
+                _this->cpu->reg.pair.C = length & 0xFF;
+                if (0 < size && 0 == result) return 0x01; // EOF
+                return result < 0 ? 0xFF : 0x00;
+            }
+            if (0x0E == portNumber) {
+                unsigned int available = _this->conin.head.load(std::memory_order_acquire) - _this->conin.tail.load(std::memory_order_relaxed);
+                if (available) return 0b01;
+                return _this->conin.eof.load(std::memory_order_acquire) ? 0b10 : 0b00;
+            }
             if (0x0F == portNumber) {
-                char buf[0x10000];
-                printf("> ");
-                memset(buf, 0, sizeof(buf));
-                fgets(buf, sizeof(buf) - 1, stdin);
                 unsigned short addr = _this->cpu->reg.pair.H;
                 addr <<= 8;
                 addr |= _this->cpu->reg.pair.L;
                 unsigned short maxLength = _this->cpu->reg.pair.B;
                 maxLength <<= 8;
                 maxLength |= _this->cpu->reg.pair.C;
-                unsigned short inputLength = strlen(buf);
-                for (int i = 0; i < inputLength && i < maxLength; i++) {
-                    _this->cpu->writeByte(addr++, buf[i]);
+                if (_this->conin.isNonBlocking) {
+                    int length = _this->readConsoleInput(addr, maxLength);
+                    bool remain = _this->conin.head.load(std::memory_order_acquire) != _this->conin.tail.load(std::memory_order_relaxed);
+                    _this->cpu->reg.pair.F = remain ? (_this->cpu->reg.pair.F | 0x01) : (_this->cpu->reg.pair.F & 0xFE);
+                    _this->cpu->reg.pair.B = (length & 0xFF00) >> 8;
+                    _this->cpu->reg.pair.C = length & 0xFF;
+                    if (0 == length && _this->conin.eof.load(std::memory_order_acquire)) return 0x01; // EOF
+                    return 0x00;
+                }
+                _this->flushConsoleOutput();
+                if (_this->conin.isPrompt) {
+                    _this->sink->write("> ", 2);
+                    _this->sink->flush();
                 }
+                int inputLength = _this->readConsoleLine();
+                _this->writeSpan(addr, _this->conin.line.data(), inputLength < maxLength ? inputLength : maxLength);
+                _this->consumeConsoleLine(inputLength);
                 return 0;
             }
         }
@@ -291,21 +1605,52 @@ class Z80Console
     {
         auto _this = (Z80Console*)ctx;
         if (!_this->ctx.startFlag || _this->ctx.endFlag) return;
-        if (_this->devices.out[portNumber]) {
-            _this->devices.out[portNumber](_this->cpu, portNumber, value);
+        _this->stats.portWrites[portNumber]++;
+        if (_this->devices.timed[portNumber]) _this->advanceDevice(_this->devices.timed[portNumber]);
+        auto device = _this->devices.port[portNumber];
+        if (device && (device->capabilities & Z80CONSOLE_DEVICE_OUT)) {
+            ProfileScope profile(_this, PROFILE_OUT, portNumber);
+            device->out(device->userData, portNumber, value);
+        } else if (_this->devices.out[portNumber]) {
+            ProfileScope profile(_this, PROFILE_OUT, portNumber); // the async output is measured until it is queued
+            if (_this->outputWorker.isAsync[portNumber] && _this->outputWorker.thread.joinable()) {
+                _this->pushOutput(portNumber, value);
+            } else {
+                _this->devices.out[portNumber](_this->cpu, portNumber, value);
+            }
         } else {
             if (portNumber < 8) {
                 _this->ctx.banks[portNumber] = value;
+                _this->stats.bankSwitches++;
+            } else if (0x0D == portNumber) {
+                unsigned short addr = _this->cpu->reg.pair.H;
+                addr <<= 8;
+                addr |= _this->cpu->reg.pair.L;
+                unsigned short size = _this->cpu->reg.pair.B;
+                size <<= 8;
+                size |= _this->cpu->reg.pair.C;
+                _this->flushConsoleOutput(); // keep the order with the console output
+                int written = _this->writeStream(addr, size);
+                _this->sink->flush();
+                _this->cpu->reg.pair.B = (written & 0xFF00) >> 8;
+                _this->cpu->reg.pair.C = written & 0xFF;
+            } else if (0x0B == portNumber) {
+                // same as 0x0F but the length is specified by BC (the value is ignored)
+                unsigned short addr = _this->cpu->reg.pair.H;
+                addr <<= 8;
+                addr |= _this->cpu->reg.pair.L;
+                unsigned short size = _this->cpu->reg.pair.B;
+                size <<= 8;
+                size |= _this->cpu->reg.pair.C;
+                _this->writeConsole(addr, size);
+            } else if (0x0E == portNumber) {
+                _this->conin.irqVector = value;
+                _this->conin.irqHead = _this->conin.head.load(std::memory_order_acquire);
             } else if (0x0F == portNumber) {
-                char buf[257];
                 unsigned short addr = _this->cpu->reg.pair.H;
                 addr <<= 8;
                 addr |= _this->cpu->reg.pair.L;
-                for (int i = 0; i < value; i++) {
-                    buf[i] = _this->cpu->readByte(addr++);
-                }
-                buf[value] = 0;
-                printf("%s", buf);
+                _this->writeConsole(addr, value);
             }
         }
     }
@@ -0,0 +1,57 @@
+/**
+ * Cosnole Computer for Z80 - Built-in Device Registry
+ * -----------------------------------------------------------------------------
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Yoji Suzuki.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ */
+#ifndef INCLUDE_Z80CONSOLE_BUILTIN_HPP
+#define INCLUDE_Z80CONSOLE_BUILTIN_HPP
+#include <map>
+#include <string>
+
+// The functions linked into the binary (z80con: builtin:name instead of a shared library)
+// - the names are resolved at runtime (no dlopen/dlsym), and the functions are still called through the function pointers of the console
+// - the functions are registered by the static initializers, so find must not be called before main starts
+// - the objects must be linked directly (the linker drops the unreferenced objects of a static library, with their registrations)
+class Z80ConsoleBuiltin
+{
+  private:
+    static std::map<std::string, void*>& registry()
+    {
+        static std::map<std::string, void*> functions;
+        return functions;
+    }
+
+  public:
+    Z80ConsoleBuiltin(const char* name, void* function) { registry()[name] = function; }
+    static void* find(const char* name)
+    {
+        auto itr = registry().find(name);
+        return itr == registry().end() ? NULL : itr->second;
+    }
+};
+
+// Register the function (in, out, read, write... or the init function of Z80ConsoleDevice) as builtin:name
+#define Z80CONSOLE_BUILTIN(name, function) static Z80ConsoleBuiltin z80ConsoleBuiltin_##name(#name, (void*)(function))
+
+#endif
@@ -0,0 +1,70 @@
+/**
+ * Cosnole Computer for Z80 - Device Descriptor (Plugin ABI v2)
+ * -----------------------------------------------------------------------------
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Yoji Suzuki.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ */
+#ifndef INCLUDE_Z80CONSOLE_DEVICE_H
+#define INCLUDE_Z80CONSOLE_DEVICE_H
+
+#define Z80CONSOLE_DEVICE_VERSION 2
+
+/* capabilities: the callbacks the device implements */
+#define Z80CONSOLE_DEVICE_IN 0x01        /* in */
+#define Z80CONSOLE_DEVICE_OUT 0x02       /* out */
+#define Z80CONSOLE_DEVICE_IN_BLOCK 0x04  /* inBlock (INIR/INDR) */
+#define Z80CONSOLE_DEVICE_OUT_BLOCK 0x08 /* outBlock (OTIR/OTDR) */
+#define Z80CONSOLE_DEVICE_TICK 0x10      /* tick */
+#define Z80CONSOLE_DEVICE_ADVANCE 0x20   /* advanceTo */
+
+/* All callbacks receive userData, so a device can keep the state per instance without globals. */
+typedef struct Z80ConsoleDevice {
+    int version;               /* Z80CONSOLE_DEVICE_VERSION */
+    unsigned int capabilities; /* Z80CONSOLE_DEVICE_* */
+    void* userData;
+    unsigned char (*in)(void* userData, unsigned char port);
+    void (*out)(void* userData, unsigned char port, unsigned char value);
+    /* buffer[0] is the first byte of the transfer (size: 1 ~ 256) */
+    void (*inBlock)(void* userData, unsigned char port, unsigned char* buffer, int size);
+    void (*outBlock)(void* userData, unsigned char port, const unsigned char* buffer, int size);
+    /* called after each execution slice with the consumed clocks */
+    void (*tick)(void* userData, int clocks);
+    /* console is the Z80Console* (optional) */
+    void (*start)(void* userData, void* console);
+    void (*end)(void* userData, void* console);
+    /* release userData when the console is destroyed (optional) */
+    void (*destroy)(void* userData);
+    /*
+     * catch up the device state to the cycle (the total clocks of the CPU), and return the cycle of the next deadline (0: none).
+     * called at the start, before each access to the device and when the deadline is reached.
+     */
+    unsigned long long (*advanceTo)(void* userData, unsigned long long cycle);
+} Z80ConsoleDevice;
+
+/*
+ * The function exported by a device plugin (-p d port lib:function).
+ * device->version is the version of the host, and the plugin fills the descriptor (returns 0 on success).
+ */
+typedef int (*Z80ConsoleDeviceInit)(Z80ConsoleDevice* device);
+
+#endif
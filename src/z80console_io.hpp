@@ -0,0 +1,186 @@
+/**
+ * Cosnole Computer for Z80 - Console Sink/Source
+ * -----------------------------------------------------------------------------
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Yoji Suzuki.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ */
+#ifndef INCLUDE_Z80CONSOLE_IO_HPP
+#define INCLUDE_Z80CONSOLE_IO_HPP
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// The destination of the console output (OUT 0x0B, OUT 0x0D, OUT 0x0F)
+class ConsoleSink
+{
+  public:
+    virtual ~ConsoleSink() {}
+    // returns the written size (-1: error)
+    virtual int write(const void* buffer, int size) = 0;
+    virtual void flush() {}
+};
+
+// The origin of the console input (IN 0x0C, IN 0x0F)
+class ConsoleSource
+{
+  public:
+    virtual ~ConsoleSource() {}
+    // returns as soon as some bytes are available (like read(2)): the read size (0: EOF, -1: error)
+    virtual int read(void* buffer, int size) = 0;
+};
+
+class StdioConsoleSink : public ConsoleSink
+{
+  private:
+    FILE* fp;
+
+  public:
+    StdioConsoleSink(FILE* fp = stdout) { this->fp = fp; }
+    int write(const void* buffer, int size) override
+    {
+        int result = (int)fwrite(buffer, 1, size, fp);
+        return 0 < result || size < 1 ? result : -1;
+    }
+    void flush() override { fflush(fp); }
+};
+
+class StdioConsoleSource : public ConsoleSource
+{
+  private:
+    FILE* fp;
+    bool isFile; // a regular file (never waits for the input)
+
+  public:
+    StdioConsoleSource(FILE* fp = stdin)
+    {
+        this->fp = fp;
+        isFile = false;
+#if defined(__unix__) || defined(__APPLE__)
+        struct stat st;
+        isFile = 0 == fstat(fileno(fp), &st) && S_ISREG(st.st_mode);
+#endif
+    }
+    // reads a regular file in bulk, and stops at a newline otherwise not to block the interactive input (a terminal or a pipe)
+    int read(void* buffer, int size) override
+    {
+        if (isFile) {
+            int length = (int)fread(buffer, 1, size, fp);
+            return 0 < length || feof(fp) || size < 1 ? length : -1;
+        }
+        unsigned char* ptr = (unsigned char*)buffer;
+        int length = 0;
+        while (length < size) {
+            int c = fgetc(fp);
+            if (EOF == c) return 0 < length || feof(fp) ? length : -1;
+            ptr[length++] = (unsigned char)c;
+            if ('\n' == c) break;
+        }
+        return length;
+    }
+};
+
+// Capture the output to a growable memory buffer
+class MemoryConsoleSink : public ConsoleSink
+{
+  private:
+    std::vector<unsigned char> buffer;
+
+  public:
+    int write(const void* data, int size) override
+    {
+        buffer.insert(buffer.end(), (const unsigned char*)data, (const unsigned char*)data + size);
+        return size;
+    }
+    const unsigned char* getData() { return buffer.data(); }
+    int getSize() { return (int)buffer.size(); }
+    void clear() { buffer.clear(); }
+};
+
+// Supply the input from a memory (the data is not copied)
+class MemoryConsoleSource : public ConsoleSource
+{
+  private:
+    const unsigned char* data;
+    int size;
+    int position;
+
+  public:
+    MemoryConsoleSource(const void* data = NULL, int size = 0) { setData(data, size); }
+    void setData(const void* data, int size)
+    {
+        this->data = (const unsigned char*)data;
+        this->size = size;
+        this->position = 0;
+    }
+    int read(void* buffer, int size) override
+    {
+        int length = this->size - position < size ? this->size - position : size;
+        if (length < 1) return 0; // EOF (data may be NULL)
+        memcpy(buffer, data + position, length);
+        position += length;
+        return length;
+    }
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+class FdConsoleSink : public ConsoleSink
+{
+  private:
+    int fd;
+
+  public:
+    FdConsoleSink(int fd = STDOUT_FILENO) { this->fd = fd; }
+    int write(const void* buffer, int size) override
+    {
+        ssize_t result;
+        do {
+            result = ::write(fd, buffer, size);
+        } while (result < 0 && EINTR == errno);
+        return (int)result;
+    }
+};
+
+class FdConsoleSource : public ConsoleSource
+{
+  private:
+    int fd;
+
+  public:
+    FdConsoleSource(int fd = STDIN_FILENO) { this->fd = fd; }
+    int read(void* buffer, int size) override
+    {
+        ssize_t result;
+        do {
+            result = ::read(fd, buffer, size);
+        } while (result < 0 && EINTR == errno);
+        return (int)result;
+    }
+};
+#endif
+
+#endif
@@ -0,0 +1,391 @@
+/**
+ * Cosnole Computer for Z80 - Instruction Trace
+ * -----------------------------------------------------------------------------
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Yoji Suzuki.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ */
+#ifndef INCLUDE_Z80CONSOLE_TRACE_HPP
+#define INCLUDE_Z80CONSOLE_TRACE_HPP
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define TRACE_RECORD_INSTRUCTION 0
+#define TRACE_RECORD_OUTPUT 1 // the console output interleaved in the trace
+#define TRACE_OUTPUT_SIZE 32
+#define TRACE_LINE_MAX 160 // the maximum length of a formatted record
+#define TRACE_QUEUE_SIZE 65536     // the records in the ring buffer (power of 2)
+#define TRACE_BUFFER_SIZE 0x100000 // the formatted lines written at once
+
+// The raw record pushed by the CPU thread (the worker thread formats it)
+struct TraceRecord {
+    unsigned long long cycle; // the clocks before the instruction
+    unsigned short pc;
+    unsigned short sp;
+    unsigned short af;
+    unsigned short bc;
+    unsigned short de;
+    unsigned short hl;
+    unsigned short ix;
+    unsigned short iy;
+    unsigned char code[4]; // the instruction bytes from pc (0xFF on the memory mapped I/O pages)
+    unsigned char bank;    // the bank selected for pc
+    unsigned char type;    // TRACE_RECORD_*
+    unsigned char size;    // TRACE_RECORD_OUTPUT: the size of data
+    unsigned char reserved;
+    unsigned char data[TRACE_OUTPUT_SIZE];
+};
+
+// The instructions to trace (all conditions must match)
+struct TraceFilter {
+    int pcStart = 0x0000;
+    int pcEnd = 0xFFFF;
+    int bank = -1;                // the bank selected for pc (-1: any)
+    unsigned long long from = 1;  // the number of the first instruction to trace (1: the first instruction after the reset)
+    unsigned long long to = 0;    // the number of the last instruction to trace (0: unlimited)
+};
+
+/**
+ * Disassemble the instruction at code (4 bytes are read at most) to buf, and return the length of the instruction.
+ * A prefix followed by another prefix is shown as DB (the CPU ignores it).
+ */
+inline int disassembleZ80(const unsigned char* code, unsigned short pc, char* buf, size_t size)
+{
+    static const char* r8[8] = {"B", "C", "D", "E", "H", "L", "(HL)", "A"};
+    static const char* halves[2][2] = {{"IXH", "IXL"}, {"IYH", "IYL"}};
+    static const char* rp[4] = {"BC", "DE", "HL", "SP"};
+    static const char* rp2[4] = {"BC", "DE", "HL", "AF"};
+    static const char* cc[8] = {"NZ", "Z", "NC", "C", "PO", "PE", "P", "M"};
+    static const char* alu[8] = {"ADD A,", "ADC A,", "SUB ", "SBC A,", "AND ", "XOR ", "OR ", "CP "};
+    static const char* rot[8] = {"RLC", "RRC", "RL", "RR", "SLA", "SRA", "SLL", "SRL"};
+    static const char* bitOp[4] = {"", "BIT", "RES", "SET"};
+    static const char* accumulator[8] = {"RLCA", "RRCA", "RLA", "RRA", "DAA", "CPL", "SCF", "CCF"};
+    static const char* edMisc[8] = {"LD I,A", "LD R,A", "LD A,I", "LD A,R", "RRD", "RLD", "NOP", "NOP"};
+    static const char* im[8] = {"0", "0/1", "1", "2", "0", "0/1", "1", "2"};
+    static const char* block[4][4] = {{"LDI", "CPI", "INI", "OUTI"},
+                                      {"LDD", "CPD", "IND", "OUTD"},
+                                      {"LDIR", "CPIR", "INIR", "OTIR"},
+                                      {"LDDR", "CPDR", "INDR", "OTDR"}};
+    int index = 0; // 0: HL, 1: IX, 2: IY
+    int n = 0;
+    if (0xDD == code[0] || 0xFD == code[0]) {
+        index = 0xDD == code[0] ? 1 : 2;
+        n = 1;
+        if (0xDD == code[1] || 0xFD == code[1] || 0xED == code[1]) {
+            snprintf(buf, size, "DB $%02X", code[0]);
+            return 1;
+        }
+    }
+    const char* hl = 0 == index ? "HL" : (1 == index ? "IX" : "IY");
+    char memory[16];
+    // (HL) or (IX+d) that reads the displacement
+    auto indirect = [&]() -> const char* {
+        if (!index) return "(HL)";
+        int d = (signed char)code[n++];
+        snprintf(memory, sizeof(memory), "(%s%c$%02X)", hl, d < 0 ? '-' : '+', d < 0 ? -d : d);
+        return memory;
+    };
+    // H and L are IXH and IXL (IYH and IYL) with the prefix unless the instruction also uses (IX+d)
+    auto reg8 = [&](int i, bool isHalf) -> const char* {
+        if (6 == i) return indirect();
+        if (index && isHalf && (4 == i || 5 == i)) return halves[index - 1][i - 4];
+        return r8[i];
+    };
+    auto byte = [&]() -> int { return code[n++]; };
+    auto word = [&]() -> int {
+        int value = code[n] | (code[n + 1] << 8);
+        n += 2;
+        return value;
+    };
+    auto relative = [&]() -> int {
+        int d = (signed char)code[n++];
+        return (pc + n + d) & 0xFFFF;
+    };
+    unsigned char op = code[n++];
+    if (0xCB == op) {
+        const char* target = index ? indirect() : NULL; // DD CB d op
+        op = code[n++];
+        int x = op >> 6, y = (op >> 3) & 7, z = op & 7;
+        if (!index) target = r8[z];
+        bool isCopy = index && 6 != z && 1 != x; // undocumented: the result is also stored to the register
+        if (0 == x) {
+            if (isCopy) {
+                snprintf(buf, size, "%s %s,%s", rot[y], target, r8[z]);
+            } else {
+                snprintf(buf, size, "%s %s", rot[y], target);
+            }
+        } else if (isCopy) {
+            snprintf(buf, size, "%s %d,%s,%s", bitOp[x], y, target, r8[z]);
+        } else {
+            snprintf(buf, size, "%s %d,%s", bitOp[x], y, target);
+        }
+        return n;
+    }
+    if (0xED == op) {
+        op = code[n++];
+        int x = op >> 6, y = (op >> 3) & 7, z = op & 7, p = y >> 1, q = y & 1;
+        if (1 == x) {
+            switch (z) {
+                case 0:
+                    if (6 == y) {
+                        snprintf(buf, size, "IN (C)");
+                    } else {
+                        snprintf(buf, size, "IN %s,(C)", r8[y]);
+                    }
+                    break;
+                case 1:
+                    if (6 == y) {
+                        snprintf(buf, size, "OUT (C),0");
+                    } else {
+                        snprintf(buf, size, "OUT (C),%s", r8[y]);
+                    }
+                    break;
+                case 2: snprintf(buf, size, "%s HL,%s", q ? "ADC" : "SBC", rp[p]); break;
+                case 3: {
+                    int nn = word();
+                    if (q) {
+                        snprintf(buf, size, "LD %s,($%04X)", rp[p], nn);
+                    } else {
+                        snprintf(buf, size, "LD ($%04X),%s", nn, rp[p]);
+                    }
+                    break;
+                }
+                case 4: snprintf(buf, size, "NEG"); break;
+                case 5: snprintf(buf, size, 1 == y ? "RETI" : "RETN"); break;
+                case 6: snprintf(buf, size, "IM %s", im[y]); break;
+                default: snprintf(buf, size, "%s", edMisc[y]); break;
+            }
+        } else if (2 == x && z <= 3 && 4 <= y) {
+            snprintf(buf, size, "%s", block[y - 4][z]);
+        } else {
+            snprintf(buf, size, "DB $ED,$%02X", op);
+        }
+        return n;
+    }
+    int x = op >> 6, y = (op >> 3) & 7, z = op & 7, p = y >> 1, q = y & 1;
+    const char* pair = 2 == p ? hl : rp[p];
+    switch (x) {
+        case 0:
+            switch (z) {
+                case 0:
+                    if (0 == y) {
+                        snprintf(buf, size, "NOP");
+                    } else if (1 == y) {
+                        snprintf(buf, size, "EX AF,AF'");
+                    } else {
+                        int target = relative();
+                        if (2 == y) {
+                            snprintf(buf, size, "DJNZ $%04X", target);
+                        } else if (3 == y) {
+                            snprintf(buf, size, "JR $%04X", target);
+                        } else {
+                            snprintf(buf, size, "JR %s,$%04X", cc[y - 4], target);
+                        }
+                    }
+                    break;
+                case 1:
+                    if (q) {
+                        snprintf(buf, size, "ADD %s,%s", hl, pair);
+                    } else {
+                        int nn = word();
+                        snprintf(buf, size, "LD %s,$%04X", pair, nn);
+                    }
+                    break;
+                case 2:
+                    if (p < 2) {
+                        snprintf(buf, size, q ? "LD A,(%s)" : "LD (%s),A", rp[p]);
+                    } else {
+                        int nn = word();
+                        if (2 == p) {
+                            if (q) {
+                                snprintf(buf, size, "LD %s,($%04X)", hl, nn);
+                            } else {
+                                snprintf(buf, size, "LD ($%04X),%s", nn, hl);
+                            }
+                        } else {
+                            snprintf(buf, size, q ? "LD A,($%04X)" : "LD ($%04X),A", nn);
+                        }
+                    }
+                    break;
+                case 3: snprintf(buf, size, "%s %s", q ? "DEC" : "INC", pair); break;
+                case 4: snprintf(buf, size, "INC %s", reg8(y, true)); break;
+                case 5: snprintf(buf, size, "DEC %s", reg8(y, true)); break;
+                case 6: {
+                    const char* target = reg8(y, true);
+                    int value = byte();
+                    snprintf(buf, size, "LD %s,$%02X", target, value);
+                    break;
+                }
+                default: snprintf(buf, size, "%s", accumulator[y]); break;
+            }
+            break;
+        case 1:
+            if (6 == y && 6 == z) {
+                snprintf(buf, size, "HALT");
+            } else {
+                bool isHalf = 6 != y && 6 != z;
+                const char* dst = reg8(y, isHalf);
+                const char* src = reg8(z, isHalf);
+                snprintf(buf, size, "LD %s,%s", dst, src);
+            }
+            break;
+        case 2: snprintf(buf, size, "%s%s", alu[y], reg8(z, true)); break;
+        default:
+            switch (z) {
+                case 0: snprintf(buf, size, "RET %s", cc[y]); break;
+                case 1:
+                    if (!q) {
+                        snprintf(buf, size, "POP %s", 2 == p ? hl : rp2[p]);
+                    } else if (0 == p) {
+                        snprintf(buf, size, "RET");
+                    } else if (1 == p) {
+                        snprintf(buf, size, "EXX");
+                    } else if (2 == p) {
+                        snprintf(buf, size, "JP (%s)", hl);
+                    } else {
+                        snprintf(buf, size, "LD SP,%s", hl);
+                    }
+                    break;
+                case 2: {
+                    int nn = word();
+                    snprintf(buf, size, "JP %s,$%04X", cc[y], nn);
+                    break;
+                }
+                case 3:
+                    switch (y) {
+                        case 0: snprintf(buf, size, "JP $%04X", word()); break;
+                        case 2: snprintf(buf, size, "OUT ($%02X),A", byte()); break;
+                        case 3: snprintf(buf, size, "IN A,($%02X)", byte()); break;
+                        case 4: snprintf(buf, size, "EX (SP),%s", hl); break;
+                        case 5: snprintf(buf, size, "EX DE,HL"); break;
+                        case 6: snprintf(buf, size, "DI"); break;
+                        default: snprintf(buf, size, "EI"); break;
+                    }
+                    break;
+                case 4: {
+                    int nn = word();
+                    snprintf(buf, size, "CALL %s,$%04X", cc[y], nn);
+                    break;
+                }
+                case 5:
+                    if (q) {
+                        snprintf(buf, size, "CALL $%04X", word()); // p is 0 (the prefixes are handled above)
+                    } else {
+                        snprintf(buf, size, "PUSH %s", 2 == p ? hl : rp2[p]);
+                    }
+                    break;
+                case 6: snprintf(buf, size, "%s$%02X", alu[y], byte()); break;
+                default: snprintf(buf, size, "RST $%02X", y * 8); break;
+            }
+            break;
+    }
+    return n;
+}
+
+// Format the records on the worker thread (the disassembly is cached by the address)
+class TraceFormatter
+{
+  private:
+    struct Entry {
+        bool isValid;
+        unsigned char code[4];
+        int length;         // the length of the instruction
+        char text[40];      // the instruction bytes and the mnemonic (padded)
+        int textLength;
+    };
+    std::vector<Entry> cache;
+
+    inline static char* hex(char* ptr, unsigned int value, int digits)
+    {
+        static const char digit[] = "0123456789ABCDEF";
+        for (int i = digits - 1; 0 <= i; i--) ptr[i] = digit[value & 0x0F], value >>= 4;
+        return ptr + digits;
+    }
+
+    inline static char* reg(char* ptr, const char* name, unsigned short value)
+    {
+        *ptr++ = ' ';
+        *ptr++ = name[0];
+        *ptr++ = name[1];
+        *ptr++ = '=';
+        return hex(ptr, value, 4);
+    }
+
+  public:
+    TraceFormatter() : cache(0x10000) {}
+
+    // Format a record as a line (or copy the console output), and return the length (buf must have TRACE_LINE_MAX bytes)
+    int format(const TraceRecord* record, char* buf)
+    {
+        if (TRACE_RECORD_OUTPUT == record->type) {
+            memcpy(buf, record->data, record->size);
+            return record->size;
+        }
+        Entry* entry = &cache[record->pc];
+        if (!entry->isValid || memcmp(entry->code, record->code, 4)) {
+            char mnemonic[32];
+            entry->length = disassembleZ80(record->code, record->pc, mnemonic, sizeof(mnemonic));
+            char bytes[16];
+            char* ptr = bytes;
+            for (int i = 0; i < entry->length; i++) {
+                ptr = hex(ptr, record->code[i], 2);
+                *ptr++ = ' ';
+            }
+            *ptr = '\0';
+            entry->textLength = snprintf(entry->text, sizeof(entry->text), "%-12s%-20s", bytes, mnemonic);
+            if ((int)sizeof(entry->text) <= entry->textLength) entry->textLength = sizeof(entry->text) - 1;
+            memcpy(entry->code, record->code, 4);
+            entry->isValid = true;
+        }
+        char* ptr = buf;
+        *ptr++ = '[';
+        ptr = hex(ptr, record->pc, 4);
+        *ptr++ = ']';
+        *ptr++ = ' ';
+        memcpy(ptr, entry->text, entry->textLength);
+        ptr += entry->textLength;
+        ptr = reg(ptr, "AF", record->af);
+        ptr = reg(ptr, "BC", record->bc);
+        ptr = reg(ptr, "DE", record->de);
+        ptr = reg(ptr, "HL", record->hl);
+        ptr = reg(ptr, "IX", record->ix);
+        ptr = reg(ptr, "IY", record->iy);
+        ptr = reg(ptr, "SP", record->sp);
+        memcpy(ptr, " BK=", 4);
+        ptr = hex(ptr + 4, record->bank, 2);
+        memcpy(ptr, " CY=", 4);
+        ptr += 4;
+        char digits[20];
+        int count = 0;
+        unsigned long long cycle = record->cycle;
+        do {
+            digits[count++] = (char)('0' + cycle % 10);
+            cycle /= 10;
+        } while (cycle);
+        while (count) *ptr++ = digits[--count];
+        *ptr++ = '\n';
+        return (int)(ptr - buf);
+    }
+};
+
+#endif